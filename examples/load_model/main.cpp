@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 
 #include "cppflow/ops.h"
@@ -12,5 +13,11 @@ int main() {
     
     std::cout << output << std::endl;
 
+    // Bind the input and output once, then run with the preallocated input
+    auto call = model.prepare({{10, 5}});
+    std::fill(call.input<float>(0), call.input<float>(0) + 50, 1.0f);
+    call.run();
+    std::cout << call.output<float>(0)[0] << std::endl;
+
     return 0;
 }
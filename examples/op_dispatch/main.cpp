@@ -0,0 +1,56 @@
+#include <chrono>
+#include <iostream>
+
+#include "cppflow/ops.h"
+
+// Measures the cost of dispatching a small elementwise op, with and without the per-thread op cache
+
+const int iterations = 100000;
+
+// What every generated op did before the cache: create, execute and delete a TFE_Op
+cppflow::tensor uncached_add(const cppflow::tensor& x, const cppflow::tensor& y) {
+    auto op = TFE_NewOp(context::get_context(), "AddV2", context::get_status());
+    status_check(context::get_status());
+
+    TFE_OpAddInput(op, x.tfe_handle.get(), context::get_status());
+    status_check(context::get_status());
+    TFE_OpAddInput(op, y.tfe_handle.get(), context::get_status());
+    status_check(context::get_status());
+
+    int num_outputs_op = 1;
+    TFE_TensorHandle* res[1] = {nullptr};
+    TFE_Execute(op, res, &num_outputs_op, context::get_status());
+    status_check(context::get_status());
+    TFE_DeleteOp(op);
+    return cppflow::tensor(res[0]);
+}
+
+template<typename F>
+double time_per_op(F f) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
+
+int main() {
+
+    auto x = cppflow::tensor({1.0f, 2.0f, 3.0f, 4.0f});
+    auto y = cppflow::tensor({4.0f, 3.0f, 2.0f, 1.0f});
+
+    // Warm up the runtime and the kernel cache
+    for (int i = 0; i < 1000; i++) {
+        uncached_add(x, y);
+        cppflow::add_v2(x, y);
+    }
+
+    auto uncached = time_per_op([&]() { uncached_add(x, y); });
+    auto cached = time_per_op([&]() { cppflow::add_v2(x, y); });
+
+    std::cout << "TFE_NewOp per call: " << uncached << " us/op" << std::endl;
+    std::cout << "Per-thread op cache: " << cached << " us/op" << std::endl;
+    std::cout << "Dispatch overhead reduction: " << (1.0 - cached / uncached) * 100.0 << "%" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,344 @@
+//
+// Host memory helpers for tensor buffers
+//
+
+#ifndef CPPFLOW2_ALLOCATOR_H
+#define CPPFLOW2_ALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace cppflow {
+
+    /**
+     * Alignment TensorFlow requires to use a host buffer in place. TF_NewTensor copies any
+     * buffer that is not aligned to EIGEN_MAX_ALIGN_BYTES, which is at most 64 bytes.
+     */
+    constexpr size_t tensor_alignment = 64;
+
+    /**
+     * @return True if data can be handed to TensorFlow without being copied
+     */
+    bool is_aligned(const void* data);
+
+    /**
+     * @class aligned_allocator
+     * @brief Standard allocator returning tensor_alignment aligned memory
+     *
+     * A std::vector<T, aligned_allocator<T>> can always be moved into a tensor without copies.
+     */
+    template<typename T>
+    class aligned_allocator {
+    public:
+        using value_type = T;
+
+        aligned_allocator() noexcept = default;
+
+        template<typename U>
+        aligned_allocator(const aligned_allocator<U>&) noexcept {}
+
+        T* allocate(size_t n);
+        void deallocate(T* p, size_t n) noexcept;
+
+        template<typename U>
+        bool operator==(const aligned_allocator<U>&) const noexcept { return true; }
+
+        template<typename U>
+        bool operator!=(const aligned_allocator<U>&) const noexcept { return false; }
+    };
+
+    /**
+     * @struct buffer_pool_options
+     * @brief Limits of the host buffer pool
+     */
+    struct buffer_pool_options {
+        /// Keep released buffers for reuse. When false, buffers are freed as soon as they are released
+        bool enabled = true;
+
+        /// Maximum size, in bytes, of the idle buffers kept by the pool (thread caches included)
+        size_t max_bytes_held = size_t(256) << 20;
+
+        /// Idle buffers each thread keeps per size class before handing them to the shared lists
+        size_t thread_cache_buffers = 4;
+    };
+
+    /**
+     * @struct buffer_pool_stats
+     * @brief Counters of the host buffer pool
+     */
+    struct buffer_pool_stats {
+        /// Allocations served with an idle buffer
+        uint64_t hits = 0;
+
+        /// Allocations that needed new memory
+        uint64_t misses = 0;
+
+        /// Allocations larger than buffer_pool::max_pooled_size, never pooled
+        uint64_t oversized = 0;
+
+        /// Bytes of idle buffers held by the pool
+        uint64_t bytes_held = 0;
+
+        /// Bytes of pooled buffers currently in use
+        uint64_t bytes_in_use = 0;
+
+        /**
+         * @return Fraction of the poolable allocations served with an idle buffer
+         */
+        double hit_rate() const { return hits + misses == 0 ? 0.0 : double(hits) / double(hits + misses); }
+    };
+
+    /**
+     * @class buffer_pool
+     * @brief Pool of tensor_alignment aligned host buffers used to back tensors
+     *
+     * Buffers are grouped in power of two size classes, from 64 bytes to max_pooled_size. Released
+     * buffers go first to a small cache of the releasing thread, then to lists shared by all threads,
+     * and are freed once the pool holds max_bytes_held idle bytes.
+     */
+    class buffer_pool {
+    public:
+        static constexpr size_t min_pooled_size = 64;
+        static constexpr size_t max_pooled_size = size_t(64) << 20;
+
+        /**
+         * @return The pool used by the tensor constructors
+         */
+        static buffer_pool& global();
+
+        /**
+         * Changes the limits of the pool. Idle buffers above the new limits are released lazily
+         */
+        void configure(const buffer_pool_options& options);
+
+        /**
+         * @return A tensor_alignment aligned buffer of at least len bytes
+         */
+        void* allocate(size_t len);
+
+        /**
+         * Gives back a buffer obtained with allocate(len)
+         */
+        void deallocate(void* data, size_t len);
+
+        /**
+         * Deallocator to pass to TF_NewTensor, with the pool as argument
+         */
+        static void tensor_deallocator(void* data, size_t len, void* pool);
+
+        /**
+         * @return A snapshot of the pool counters
+         */
+        buffer_pool_stats stats() const;
+
+        /**
+         * Frees the idle buffers of the shared lists and of the calling thread cache
+         */
+        void trim();
+
+        buffer_pool(const buffer_pool&)             = delete;
+        buffer_pool& operator=(const buffer_pool&)  = delete;
+
+    private:
+        static constexpr size_t num_classes = 21; // 64 B to 64 MB
+
+        struct thread_cache {
+            std::vector<void*> buffers[num_classes];
+            ~thread_cache();
+        };
+
+        buffer_pool() = default;
+
+        static size_t size_class(size_t len);
+        static size_t class_size(size_t size_class) { return min_pooled_size << size_class; }
+        static void* new_buffer(size_t size);
+        static void delete_buffer(void* data);
+
+        thread_cache& local();
+        void release(void* data, size_t size_class);
+
+        std::atomic<bool> enabled_{true};
+        std::atomic<size_t> max_bytes_held_{size_t(256) << 20};
+        std::atomic<size_t> thread_cache_buffers_{4};
+
+        std::mutex mutex_;
+        std::vector<void*> shared_[num_classes];
+
+        std::atomic<uint64_t> hits_{0};
+        std::atomic<uint64_t> misses_{0};
+        std::atomic<uint64_t> oversized_{0};
+        std::atomic<uint64_t> bytes_held_{0};
+        std::atomic<uint64_t> bytes_in_use_{0};
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    bool is_aligned(const void* data) {
+        return reinterpret_cast<uintptr_t>(data) % tensor_alignment == 0;
+    }
+
+    buffer_pool& buffer_pool::global() {
+        // Never destroyed: tensors released during static destruction still give their buffers back
+        static buffer_pool* pool = new buffer_pool();
+        return *pool;
+    }
+
+    void buffer_pool::configure(const buffer_pool_options& options) {
+        this->enabled_ = options.enabled;
+        this->max_bytes_held_ = options.max_bytes_held;
+        this->thread_cache_buffers_ = options.thread_cache_buffers;
+    }
+
+    void* buffer_pool::allocate(size_t len) {
+        if (len > max_pooled_size) {
+            this->oversized_.fetch_add(1, std::memory_order_relaxed);
+            return new_buffer(len);
+        }
+
+        auto c = size_class(len);
+        this->bytes_in_use_.fetch_add(class_size(c), std::memory_order_relaxed);
+
+        auto& cache = this->local().buffers[c];
+        if (!cache.empty()) {
+            auto* data = cache.back();
+            cache.pop_back();
+            this->bytes_held_.fetch_sub(class_size(c), std::memory_order_relaxed);
+            this->hits_.fetch_add(1, std::memory_order_relaxed);
+            return data;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            if (!this->shared_[c].empty()) {
+                auto* data = this->shared_[c].back();
+                this->shared_[c].pop_back();
+                this->bytes_held_.fetch_sub(class_size(c), std::memory_order_relaxed);
+                this->hits_.fetch_add(1, std::memory_order_relaxed);
+                return data;
+            }
+        }
+
+        this->misses_.fetch_add(1, std::memory_order_relaxed);
+        return new_buffer(class_size(c));
+    }
+
+    void buffer_pool::deallocate(void* data, size_t len) {
+        if (data == nullptr)
+            return;
+
+        if (len > max_pooled_size) {
+            delete_buffer(data);
+            return;
+        }
+
+        auto c = size_class(len);
+        this->bytes_in_use_.fetch_sub(class_size(c), std::memory_order_relaxed);
+
+        if (this->enabled_ && this->bytes_held_.load(std::memory_order_relaxed) + class_size(c) <= this->max_bytes_held_) {
+            auto& cache = this->local().buffers[c];
+            if (cache.size() < this->thread_cache_buffers_) {
+                cache.push_back(data);
+                this->bytes_held_.fetch_add(class_size(c), std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        this->release(data, c);
+    }
+
+    void buffer_pool::tensor_deallocator(void* data, size_t len, void* pool) {
+        static_cast<buffer_pool*>(pool)->deallocate(data, len);
+    }
+
+    buffer_pool_stats buffer_pool::stats() const {
+        buffer_pool_stats stats;
+        stats.hits = this->hits_.load(std::memory_order_relaxed);
+        stats.misses = this->misses_.load(std::memory_order_relaxed);
+        stats.oversized = this->oversized_.load(std::memory_order_relaxed);
+        stats.bytes_held = this->bytes_held_.load(std::memory_order_relaxed);
+        stats.bytes_in_use = this->bytes_in_use_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void buffer_pool::trim() {
+        auto& cache = this->local();
+        for (size_t c = 0; c < num_classes; c++) {
+            for (auto* data : cache.buffers[c])
+                delete_buffer(data);
+            this->bytes_held_.fetch_sub(cache.buffers[c].size() * class_size(c), std::memory_order_relaxed);
+            cache.buffers[c].clear();
+        }
+
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        for (size_t c = 0; c < num_classes; c++) {
+            for (auto* data : this->shared_[c])
+                delete_buffer(data);
+            this->bytes_held_.fetch_sub(this->shared_[c].size() * class_size(c), std::memory_order_relaxed);
+            this->shared_[c].clear();
+        }
+    }
+
+    size_t buffer_pool::size_class(size_t len) {
+        size_t c = 0;
+        while (class_size(c) < len)
+            c++;
+        return c;
+    }
+
+    void* buffer_pool::new_buffer(size_t size) {
+        return ::operator new(size, std::align_val_t(tensor_alignment));
+    }
+
+    void buffer_pool::delete_buffer(void* data) {
+        ::operator delete(data, std::align_val_t(tensor_alignment));
+    }
+
+    buffer_pool::thread_cache& buffer_pool::local() {
+        thread_local thread_cache cache;
+        return cache;
+    }
+
+    void buffer_pool::release(void* data, size_t size_class) {
+        // Called for buffers that are not in the pool yet: keep them in the shared lists if allowed
+        if (this->enabled_) {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            if (this->bytes_held_.load(std::memory_order_relaxed) + class_size(size_class) <= this->max_bytes_held_) {
+                this->shared_[size_class].push_back(data);
+                this->bytes_held_.fetch_add(class_size(size_class), std::memory_order_relaxed);
+                return;
+            }
+        }
+        delete_buffer(data);
+    }
+
+    buffer_pool::thread_cache::~thread_cache() {
+        // Hand the idle buffers of an exiting thread to the other threads
+        auto& pool = buffer_pool::global();
+        for (size_t c = 0; c < num_classes; c++) {
+            pool.bytes_held_.fetch_sub(this->buffers[c].size() * class_size(c), std::memory_order_relaxed);
+            for (auto* data : this->buffers[c])
+                pool.release(data, c);
+        }
+    }
+
+    template<typename T>
+    T* aligned_allocator<T>::allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(tensor_alignment)));
+    }
+
+    template<typename T>
+    void aligned_allocator<T>::deallocate(T* p, size_t) noexcept {
+        ::operator delete(p, std::align_val_t(tensor_alignment));
+    }
+}
+
+#endif //CPPFLOW2_ALLOCATOR_H
@@ -0,0 +1,434 @@
+//
+// Dynamic request batching on top of model
+//
+
+#ifndef CPPFLOW2_BATCHING_H
+#define CPPFLOW2_BATCHING_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "allocator.h"
+#include "model.h"
+#include "tensor.h"
+
+namespace cppflow {
+
+    /**
+     * @struct batching_options
+     * @brief How a batching_model groups requests
+     */
+    struct batching_options {
+        /// Maximum number of rows (sum of the leading dimensions of the requests) in a batch
+        size_t max_batch_size = 32;
+
+        /// Maximum time the oldest request waits for the batch to fill up
+        std::chrono::microseconds max_queue_delay{1000};
+
+        /// Batch sizes the model is run with, sorted. Batches are padded with zeros up to the smallest
+        /// one that fits, so only these shapes reach the session. Empty runs every batch at its own size
+        std::vector<size_t> allowed_batch_sizes;
+
+        /// Maximum number of prepared calls kept, one per batch size and input shapes, each holding
+        /// preallocated inputs. The least recently used one is released beyond it
+        size_t max_prepared_calls = 16;
+    };
+
+    /**
+     * @struct histogram
+     * @brief Counts of the values recorded in each bucket
+     */
+    struct histogram {
+        /// Upper bound (inclusive) of each bucket. The last bucket has no upper bound
+        std::vector<double> bounds;
+
+        /// Number of values in each bucket, one more than bounds
+        std::vector<uint64_t> counts;
+
+        uint64_t count = 0;
+        double sum = 0;
+
+        explicit histogram(std::vector<double> bounds = {});
+
+        void record(double value);
+
+        /**
+         * @return Mean of the recorded values
+         */
+        double mean() const { return count == 0 ? 0.0 : sum / double(count); }
+    };
+
+    /**
+     * @struct batching_stats
+     * @brief Counters of a batching_model
+     */
+    struct batching_stats {
+        uint64_t requests = 0;
+        uint64_t batches = 0;
+
+        /// Rows added to reach an allowed batch size
+        uint64_t padded_rows = 0;
+
+        /// Output slices that had to be copied because they were misaligned or aliased an input
+        uint64_t copied_slices = 0;
+
+        /// Batches whose run failed, and the requests they held. Those are not counted above
+        uint64_t failed_batches = 0;
+        uint64_t failed_requests = 0;
+
+        /// Prepared calls released to stay within max_prepared_calls
+        uint64_t evicted_calls = 0;
+
+        /// Rows per batch, before padding
+        histogram batch_size;
+
+        /// Time between the submission of a request and the run of its batch, in microseconds
+        histogram queue_wait_us;
+    };
+
+    /**
+     * @class batching_model
+     * @brief Groups requests submitted from many threads into batches run with a single session call
+     *
+     * Each input of a request has the batch as its leading dimension (usually 1). Requests whose inputs
+     * have the same datatypes and trailing dimensions are concatenated into the preallocated inputs of a
+     * model::prepared_call, and every output is split back along its leading dimension. The slices share
+     * the buffer of the batch output when it is aligned, so no copy is made.
+     *
+     * A single scheduler thread forms and runs the batches. The model must outlive the batching_model.
+     */
+    class batching_model {
+    public:
+        explicit batching_model(model& m, const batching_options& options = batching_options());
+
+        /**
+         * Runs the pending requests and stops the scheduler
+         */
+        ~batching_model();
+
+        batching_model(const batching_model&)             = delete;
+        batching_model& operator=(const batching_model&)  = delete;
+
+        /**
+         * Queues a request
+         * @param inputs The inputs of the model, all with the same leading dimension
+         * @return The outputs of the model for this request
+         * @throws std::runtime_error If the inputs have no leading dimension
+         */
+        std::future<std::vector<tensor>> submit(std::vector<tensor> inputs);
+
+        /**
+         * @return A snapshot of the counters
+         */
+        batching_stats stats() const;
+
+    private:
+        struct request {
+            std::vector<tensor> inputs;
+            std::vector<std::vector<int64_t>> dims;
+            int64_t rows;
+            std::chrono::steady_clock::time_point enqueued;
+            std::promise<std::vector<tensor>> result;
+        };
+
+        void loop();
+        void run_batch(std::vector<request>& batch);
+        size_t padded_size(size_t rows) const;
+        static bool compatible(const request& a, const request& b);
+
+        model& model_;
+        batching_options options_;
+
+        model::prepared_call& prepared(const std::vector<int64_t>& key, const std::vector<std::vector<int64_t>>& shapes);
+
+        struct cached_call {
+            model::prepared_call call;
+            uint64_t last_used;
+        };
+
+        // Bound calls, keyed by batch size and trailing dimensions of the inputs. Only used by the scheduler
+        std::map<std::vector<int64_t>, cached_call> calls_;
+        uint64_t uses_ = 0;
+
+        mutable std::mutex mutex_;
+        std::condition_variable cv_;
+        std::deque<request> queue_;
+        size_t queued_rows_ = 0;
+        bool stop_ = false;
+
+        mutable std::mutex stats_mutex_;
+        batching_stats stats_;
+
+        std::thread scheduler_;
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    histogram::histogram(std::vector<double> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+
+    void histogram::record(double value) {
+        auto it = std::lower_bound(this->bounds.begin(), this->bounds.end(), value);
+        this->counts[it - this->bounds.begin()]++;
+        this->count++;
+        this->sum += value;
+    }
+
+    batching_model::batching_model(model& m, const batching_options& options) : model_(m), options_(options) {
+        if (this->options_.max_batch_size == 0)
+            throw std::runtime_error{"max_batch_size must be positive"};
+        if (this->options_.max_prepared_calls == 0)
+            throw std::runtime_error{"max_prepared_calls must be positive"};
+        std::sort(this->options_.allowed_batch_sizes.begin(), this->options_.allowed_batch_sizes.end());
+
+        std::vector<double> sizes;
+        for (size_t i = 1; i <= this->options_.max_batch_size; i++)
+            sizes.push_back(double(i));
+        this->stats_.batch_size = histogram(sizes);
+
+        std::vector<double> waits;
+        for (double us = 1; us <= 1e6; us *= 2)
+            waits.push_back(us);
+        this->stats_.queue_wait_us = histogram(waits);
+
+        this->scheduler_ = std::thread(&batching_model::loop, this);
+    }
+
+    batching_model::~batching_model() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->stop_ = true;
+        }
+        this->cv_.notify_all();
+        this->scheduler_.join();
+    }
+
+    std::future<std::vector<tensor>> batching_model::submit(std::vector<tensor> inputs) {
+        request req;
+        req.rows = -1;
+        for (auto& input : inputs) {
+            auto dims = input.dims().to_vector();
+            if (dims.empty() || (req.rows >= 0 && dims[0] != req.rows))
+                throw std::runtime_error{"The inputs of a request must share their leading dimension"};
+            req.rows = dims[0];
+            req.dims.push_back(std::move(dims));
+        }
+        if (req.rows <= 0)
+            throw std::runtime_error{"A request needs at least one input with at least one row"};
+
+        req.inputs = std::move(inputs);
+        req.enqueued = std::chrono::steady_clock::now();
+        auto result = req.result.get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->queued_rows_ += (size_t)req.rows;
+            this->queue_.push_back(std::move(req));
+        }
+        this->cv_.notify_one();
+        return result;
+    }
+
+    batching_stats batching_model::stats() const {
+        std::lock_guard<std::mutex> lock(this->stats_mutex_);
+        return this->stats_;
+    }
+
+    void batching_model::loop() {
+        std::unique_lock<std::mutex> lock(this->mutex_);
+        while (true) {
+            this->cv_.wait(lock, [this] { return this->stop_ || !this->queue_.empty(); });
+            if (this->queue_.empty())
+                return; // Stopped and drained
+
+            // Wait for a full batch, at most max_queue_delay after the oldest request
+            auto deadline = this->queue_.front().enqueued + this->options_.max_queue_delay;
+            this->cv_.wait_until(lock, deadline, [this] {
+                return this->stop_ || this->queued_rows_ >= this->options_.max_batch_size;
+            });
+
+            // Take the compatible requests at the front of the queue. A request larger than
+            // max_batch_size is run alone
+            std::vector<request> batch;
+            size_t rows = 0;
+            while (!this->queue_.empty()) {
+                auto& next = this->queue_.front();
+                if (!batch.empty() && (rows + (size_t)next.rows > this->options_.max_batch_size || !compatible(batch.front(), next)))
+                    break;
+                rows += (size_t)next.rows;
+                this->queued_rows_ -= (size_t)next.rows;
+                batch.push_back(std::move(next));
+                this->queue_.pop_front();
+            }
+
+            lock.unlock();
+            this->run_batch(batch);
+            lock.lock();
+        }
+    }
+
+    void batching_model::run_batch(std::vector<request>& batch) {
+        auto now = std::chrono::steady_clock::now();
+        const auto& first = batch.front();
+
+        size_t rows = 0;
+        for (auto& req : batch)
+            rows += (size_t)req.rows;
+        auto size = this->padded_size(rows);
+
+        std::vector<std::vector<tensor>> results(batch.size());
+        uint64_t copied = 0;
+        try {
+            std::vector<int64_t> key = {(int64_t)size};
+            std::vector<std::vector<int64_t>> shapes;
+            for (size_t i = 0; i < first.inputs.size(); i++) {
+                auto shape = first.dims[i];
+                shape[0] = (int64_t)size;
+                key.push_back((int64_t)first.inputs[i].dtype());
+                key.push_back((int64_t)shape.size());
+                key.insert(key.end(), shape.begin() + 1, shape.end());
+                shapes.push_back(std::move(shape));
+            }
+
+            auto& call = this->prepared(key, shapes);
+
+            if (call.num_inputs() != first.inputs.size())
+                throw std::runtime_error{"The model expects " + std::to_string(call.num_inputs()) + " inputs"};
+
+            // Concatenate the requests into the batch inputs, padding with zeros
+            std::vector<std::pair<const char*, const char*>> input_ranges;
+            for (size_t i = 0; i < call.num_inputs(); i++) {
+                if (first.inputs[i].dtype() != call.input_dtype(i))
+                    throw std::runtime_error{"Input " + std::to_string(i) + " must be " + to_string(call.input_dtype(i))};
+
+                auto* dst = static_cast<char*>(call.input_data(i));
+                auto* begin = dst;
+                for (auto& req : batch) {
+                    auto t = req.inputs[i].get_tensor();
+                    std::memcpy(dst, TF_TensorData(t.get()), TF_TensorByteSize(t.get()));
+                    dst += TF_TensorByteSize(t.get());
+                }
+                auto row_bytes = (size_t)(dst - begin) / rows;
+                std::memset(dst, 0, (size - rows) * row_bytes);
+                input_ranges.emplace_back(begin, dst + (size - rows) * row_bytes);
+            }
+
+            call.run();
+
+            for (size_t j = 0; j < call.num_outputs(); j++) {
+                auto output = call.take_output(j);
+                auto holder = output.get_tensor();
+                auto* t = holder.get();
+                auto dims = output.dims().to_vector();
+
+                // Outputs without the batch dimension are shared by all the requests
+                if (dims.empty() || dims[0] != (int64_t)size || TF_TensorType(t) == TF_STRING) {
+                    for (auto& result : results)
+                        result.push_back(output);
+                    continue;
+                }
+
+                auto* data = static_cast<char*>(TF_TensorData(t));
+                auto row_bytes = TF_TensorByteSize(t) / size;
+
+                // An output forwarding an input would be overwritten by the next batch
+                bool aliased = false;
+                for (auto& range : input_ranges)
+                    aliased |= data < range.second && range.first < data + TF_TensorByteSize(t);
+
+                auto& pool = buffer_pool::global();
+                size_t row = 0;
+                for (size_t k = 0; k < batch.size(); k++) {
+                    dims[0] = batch[k].rows;
+                    auto* slice = data + row * row_bytes;
+                    auto len = (size_t)batch[k].rows * row_bytes;
+                    row += (size_t)batch[k].rows;
+
+                    if (!aliased && is_aligned(slice)) {
+                        results[k].emplace_back(TF_TensorType(t), std::shared_ptr<void>(holder, slice), slice, len, dims);
+                    } else {
+                        auto* copy = pool.allocate(len);
+                        std::memcpy(copy, slice, len);
+                        results[k].emplace_back(TF_TensorType(t), copy, len, dims, buffer_pool::tensor_deallocator, &pool);
+                        copied++;
+                    }
+                }
+            }
+        } catch (...) {
+            for (auto& req : batch)
+                req.result.set_exception(std::current_exception());
+
+            std::lock_guard<std::mutex> lock(this->stats_mutex_);
+            this->stats_.failed_batches++;
+            this->stats_.failed_requests += batch.size();
+            return;
+        }
+
+        for (size_t k = 0; k < batch.size(); k++)
+            batch[k].result.set_value(std::move(results[k]));
+
+        std::lock_guard<std::mutex> lock(this->stats_mutex_);
+        this->stats_.batches++;
+        this->stats_.padded_rows += size - rows;
+        this->stats_.copied_slices += copied;
+        this->stats_.batch_size.record(double(rows));
+        for (auto& req : batch) {
+            this->stats_.requests++;
+            this->stats_.queue_wait_us.record(double(std::chrono::duration_cast<std::chrono::microseconds>(now - req.enqueued).count()));
+        }
+    }
+
+    model::prepared_call& batching_model::prepared(const std::vector<int64_t>& key, const std::vector<std::vector<int64_t>>& shapes) {
+        auto it = this->calls_.find(key);
+        if (it == this->calls_.end()) {
+            if (this->calls_.size() >= this->options_.max_prepared_calls) {
+                auto oldest = std::min_element(this->calls_.begin(), this->calls_.end(), [](const auto& a, const auto& b) {
+                    return a.second.last_used < b.second.last_used;
+                });
+                this->calls_.erase(oldest);
+
+                std::lock_guard<std::mutex> lock(this->stats_mutex_);
+                this->stats_.evicted_calls++;
+            }
+            it = this->calls_.emplace(key, cached_call{this->model_.prepare(shapes), 0}).first;
+        }
+
+        it->second.last_used = ++this->uses_;
+        return it->second.call;
+    }
+
+    size_t batching_model::padded_size(size_t rows) const {
+        for (auto size : this->options_.allowed_batch_sizes)
+            if (size >= rows)
+                return size;
+        return rows;
+    }
+
+    bool batching_model::compatible(const request& a, const request& b) {
+        if (a.inputs.size() != b.inputs.size())
+            return false;
+
+        for (size_t i = 0; i < a.inputs.size(); i++) {
+            if (a.inputs[i].dtype() != b.inputs[i].dtype() || a.dims[i].size() != b.dims[i].size())
+                return false;
+            if (!std::equal(a.dims[i].begin() + 1, a.dims[i].end(), b.dims[i].begin() + 1))
+                return false;
+        }
+        return true;
+    }
+}
+
+#endif //CPPFLOW2_BATCHING_H
@@ -5,8 +5,18 @@
 #ifndef CPPFLOW2_CONTEXT_H
 #define CPPFLOW2_CONTEXT_H
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
 #include <tensorflow/c/c_api.h>
 #include <tensorflow/c/eager/c_api.h>
+#include <tensorflow/c/eager/c_api_experimental.h>
+
+#include "proto.h"
 
 bool status_check(TF_Status* status) {
 
@@ -16,40 +26,429 @@ bool status_check(TF_Status* status) {
     return true;
 }
 
+namespace cppflow {
+
+    class cached_op;
+
+    /**
+     * @struct runtime_options
+     * @brief Configuration of the TensorFlow eager runtime used by all the cppflow ops
+     *
+     * The options are read when the eager context is created, so they must be set
+     * with set_runtime_options() before the first op is executed.
+     */
+    struct runtime_options {
+        /// Threads used to parallelize a single op (0 lets TensorFlow pick one per core)
+        int intra_op_threads = 0;
+
+        /// Threads used to run independent ops concurrently (0 lets TensorFlow pick one per core)
+        int inter_op_threads = 0;
+
+        /// What to do when an op input lives on a different device than the op
+        TFE_ContextDevicePlacementPolicy device_placement_policy = TFE_DEVICE_PLACEMENT_SILENT;
+
+        /// Execute eager ops asynchronously (errors surface on the next synchronizing call)
+        bool async = false;
+
+        /// Serialized ConfigProto passed to TensorFlow. The thread counts above override its values when set
+        std::string config;
+
+        /**
+         * @return The serialized ConfigProto resulting from merging config with the thread counts
+         */
+        std::string serialize_config() const;
+    };
+
+    /**
+     * Sets the options of the eager runtime
+     * @param options The options to use when the context is created
+     * @throws std::runtime_error If the context has already been created
+     */
+    void set_runtime_options(const runtime_options& options);
+
+    /**
+     * @return The options the eager runtime has been (or will be) created with
+     */
+    const runtime_options& get_runtime_options();
+}
+
+/**
+ * @class context
+ * @brief The process-wide TensorFlow eager runtime
+ *
+ * Owns the TFE_Context used by every eager op. It is created lazily on the first
+ * call to get_context() (or explicitly with init()) and lives until shutdown() or
+ * the end of the program.
+ */
 class context {
 
     public:
-        static TFE_Context* get_context() {
-            static context context; // Guaranteed to be destroyed.
-            // Instantiated on first use.
-            return context.tfe_context;
+        /**
+         * Creates the eager runtime with the given options
+         * @throws std::runtime_error If the runtime is already running
+         */
+        static void init(const cppflow::runtime_options& options);
+
+        /**
+         * Creates the eager runtime with the options given to cppflow::set_runtime_options
+         * @throws std::runtime_error If the runtime is already running
+         */
+        static void init();
+
+        /**
+         * Destroys the eager runtime. Every tensor must have been released before, the
+         * next op will create a new runtime.
+         */
+        static void shutdown();
+
+        /**
+         * @return True if the eager runtime has been created
+         */
+        static bool initialized();
+
+        /**
+         * @return The eager context, creating the runtime if needed
+         */
+        static TFE_Context* get_context();
+
+        /**
+         * @return A status owned by the calling thread, so ops can run concurrently from several threads
+         */
+        static TF_Status* get_status();
+
+        /**
+         * @return A number that changes every time the runtime is created or shut down, so objects
+         * registered with a runtime can tell whether it is still the current one
+         */
+        static uint64_t current_generation();
+
+    private:
+        explicit context(const cppflow::runtime_options& options);
+
+        static context* instance();
+        static context* create(const cppflow::runtime_options* options);
+
+        static std::mutex& mutex() {
+            static std::mutex mutex;
+            return mutex;
         }
 
-        static TF_Status* get_status() {
-            static context context; // Guaranteed to be destroyed.
-            // Instantiated on first use.
-            return context.tf_status;
+        static std::unique_ptr<context>& holder() {
+            static std::unique_ptr<context> holder;
+            return holder;
         }
-    private:
-        context() {
-            this->tf_status = TF_NewStatus();
-            this->tfe_opts = TFE_NewContextOptions();
-            this->tfe_context = TFE_NewContext(this->tfe_opts, tf_status);
-            status_check(tf_status);
+
+        static std::atomic<context*>& current() {
+            static std::atomic<context*> current{nullptr};
+            return current;
+        }
+
+        static cppflow::runtime_options& options() {
+            static cppflow::runtime_options options;
+            return options;
+        }
+
+        // Incremented every time a runtime is created, so per-thread caches can drop ops of a previous one
+        static std::atomic<uint64_t>& generation() {
+            static std::atomic<uint64_t> generation{0};
+            return generation;
         }
 
-        TF_Status* tf_status;
         TFE_Context* tfe_context;
         TFE_ContextOptions* tfe_opts;
 
+        friend class cppflow::cached_op;
+        friend void cppflow::set_runtime_options(const cppflow::runtime_options& options);
+        friend const cppflow::runtime_options& cppflow::get_runtime_options();
+
     public:
         context(context const&)         = delete;
         void operator=(context const&)  = delete;
 
         ~context() {
-            TFE_DeleteContextOptions(this->tfe_opts);
             TFE_DeleteContext(this->tfe_context);
+            TFE_DeleteContextOptions(this->tfe_opts);
         }
 };
 
+namespace cppflow {
+
+    /**
+     * @class cached_op
+     * @brief A TFE_Op borrowed from a per-thread cache
+     *
+     * Ops are kept per thread and keyed by name. When a cached_op goes out of scope its op is
+     * cleared with TFE_OpReset and returned to the cache, so the next call to the same op skips
+     * the registry lookup and the allocations made by TFE_NewOp.
+     */
+    class cached_op {
+    public:
+        /**
+         * Takes an op from the calling thread cache, or creates it if none is available
+         * @param op_name The name of the op or function to execute. Must outlive the cached_op
+         * @param cache False to create the op and delete it afterwards, for names that may be removed
+         * from the runtime, such as traced functions
+         */
+        explicit cached_op(const char* op_name, bool cache = true);
+
+        ~cached_op();
+
+        cached_op(const cached_op&)             = delete;
+        cached_op& operator=(const cached_op&)  = delete;
+
+        operator TFE_Op*() const { return this->op_; }
+
+        /**
+         * Deletes the idle ops of the calling thread cache for an op or function name, such as a
+         * function removed from the runtime. Other threads drop theirs as they get evicted
+         */
+        static void purge(const char* op_name);
+
+        /**
+         * Maximum number of idle ops kept per op name and thread
+         */
+        static constexpr size_t max_cached_per_op = 4;
+
+        /**
+         * Maximum number of op names cached per thread. The least recently used one is evicted beyond it
+         */
+        static constexpr size_t max_cached_names = 256;
+
+    private:
+        struct entry {
+            std::vector<TFE_Op*> ops;
+            uint64_t last_used = 0;
+        };
+
+        struct cache {
+            uint64_t generation = 0;
+            uint64_t uses = 0;
+            std::string key;
+            std::unordered_map<std::string, entry> ops;
+
+            void evict_least_recently_used();
+            ~cache();
+        };
+
+        static cache& local();
+
+        const char* name_;
+        TFE_Op* op_;
+        uint64_t generation_;
+        bool cache_;
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+context::context(const cppflow::runtime_options& options) {
+    auto* tf_status = context::get_status();
+    this->tfe_opts = TFE_NewContextOptions();
+
+    auto config = options.serialize_config();
+    if (!config.empty()) {
+        TFE_ContextOptionsSetConfig(this->tfe_opts, config.data(), config.size(), tf_status);
+        status_check(tf_status);
+    }
+    TFE_ContextOptionsSetAsync(this->tfe_opts, (unsigned char)options.async);
+    TFE_ContextOptionsSetDevicePlacementPolicy(this->tfe_opts, options.device_placement_policy);
+
+    this->tfe_context = TFE_NewContext(this->tfe_opts, tf_status);
+    status_check(tf_status);
+}
+
+context* context::instance() {
+    auto* ctx = current().load(std::memory_order_acquire);
+    return ctx != nullptr ? ctx : create(nullptr);
+}
+
+context* context::create(const cppflow::runtime_options* options) {
+    std::lock_guard<std::mutex> lock(mutex());
+
+    auto* ctx = current().load(std::memory_order_relaxed);
+    if (ctx != nullptr) {
+        if (options != nullptr)
+            throw std::runtime_error{"The eager runtime is already initialized"};
+        return ctx;
+    }
+
+    if (options != nullptr)
+        context::options() = *options;
+
+    holder().reset(new context(context::options()));
+    generation().fetch_add(1, std::memory_order_relaxed);
+    current().store(holder().get(), std::memory_order_release);
+    return holder().get();
+}
+
+void context::init(const cppflow::runtime_options& options) {
+    create(&options);
+}
+
+void context::init() {
+    create(&context::options());
+}
+
+void context::shutdown() {
+    std::lock_guard<std::mutex> lock(mutex());
+    current().store(nullptr, std::memory_order_release);
+
+    // Cached ops belong to the context being deleted: the per-thread caches must drop them, not delete them
+    generation().fetch_add(1, std::memory_order_relaxed);
+    holder().reset();
+}
+
+bool context::initialized() {
+    return current().load(std::memory_order_acquire) != nullptr;
+}
+
+TFE_Context* context::get_context() {
+    return instance()->tfe_context;
+}
+
+uint64_t context::current_generation() {
+    return generation().load(std::memory_order_relaxed);
+}
+
+TF_Status* context::get_status() {
+    thread_local std::unique_ptr<TF_Status, decltype(&TF_DeleteStatus)> status(TF_NewStatus(), TF_DeleteStatus);
+    return status.get();
+}
+
+namespace cppflow {
+
+    cached_op::cached_op(const char* op_name, bool cache_op) : name_(op_name), op_(nullptr), cache_(cache_op) {
+        auto* ctx = context::get_context();
+
+        this->generation_ = context::generation().load(std::memory_order_relaxed);
+        if (!this->cache_) {
+            this->op_ = TFE_NewOp(ctx, op_name, context::get_status());
+            status_check(context::get_status());
+            return;
+        }
+
+        auto& cache = local();
+
+        if (cache.generation != this->generation_) {
+            // Ops of a runtime that has been shut down can not be reused nor safely deleted
+            cache.ops.clear();
+            cache.generation = this->generation_;
+        }
+
+        cache.key.assign(op_name);
+        auto it = cache.ops.find(cache.key);
+        if (it != cache.ops.end() && !it->second.ops.empty()) {
+            it->second.last_used = ++cache.uses;
+            this->op_ = it->second.ops.back();
+            it->second.ops.pop_back();
+            return;
+        }
+
+        this->op_ = TFE_NewOp(ctx, op_name, context::get_status());
+        status_check(context::get_status());
+    }
+
+    cached_op::~cached_op() {
+        auto& cache = local();
+
+        // The runtime has been shut down while the op was in use, its context is gone
+        if (this->generation_ != context::generation().load(std::memory_order_relaxed))
+            return;
+
+        if (!this->cache_) {
+            TFE_DeleteOp(this->op_);
+            return;
+        }
+
+        // Clear inputs and attributes so the op does not keep tensors alive while idle
+        TFE_OpReset(this->op_, this->name_, nullptr, context::get_status());
+        if (TF_GetCode(context::get_status()) == TF_OK) {
+            cache.key.assign(this->name_);
+            auto it = cache.ops.find(cache.key);
+            if (it == cache.ops.end()) {
+                if (cache.ops.size() >= max_cached_names)
+                    cache.evict_least_recently_used();
+                it = cache.ops.emplace(cache.key, entry()).first;
+            }
+
+            it->second.last_used = ++cache.uses;
+            if (it->second.ops.size() < max_cached_per_op) {
+                it->second.ops.push_back(this->op_);
+                return;
+            }
+        }
+
+        TFE_DeleteOp(this->op_);
+    }
+
+    void cached_op::purge(const char* op_name) {
+        auto& cache = local();
+        if (cache.generation != context::generation().load(std::memory_order_relaxed))
+            return;
+
+        cache.key.assign(op_name);
+        auto it = cache.ops.find(cache.key);
+        if (it == cache.ops.end())
+            return;
+
+        for (auto* op : it->second.ops)
+            TFE_DeleteOp(op);
+        cache.ops.erase(it);
+    }
+
+    cached_op::cache& cached_op::local() {
+        thread_local cache cache;
+        return cache;
+    }
+
+    cached_op::cache::~cache() {
+        if (this->generation != context::generation().load(std::memory_order_relaxed))
+            return;
+
+        for (auto& entry : this->ops)
+            for (auto* op : entry.second.ops)
+                TFE_DeleteOp(op);
+    }
+
+    void cached_op::cache::evict_least_recently_used() {
+        auto oldest = this->ops.begin();
+        for (auto it = this->ops.begin(); it != this->ops.end(); ++it)
+            if (it->second.last_used < oldest->second.last_used)
+                oldest = it;
+
+        if (oldest == this->ops.end())
+            return;
+
+        for (auto* op : oldest->second.ops)
+            TFE_DeleteOp(op);
+        this->ops.erase(oldest);
+    }
+
+    std::string runtime_options::serialize_config() const {
+        // ConfigProto fields: intra_op_parallelism_threads = 2, inter_op_parallelism_threads = 5
+        proto::writer config;
+        config.merge(this->config);
+        if (this->intra_op_threads > 0)
+            config.varint(2, this->intra_op_threads);
+        if (this->inter_op_threads > 0)
+            config.varint(5, this->inter_op_threads);
+
+        return config.str();
+    }
+
+    void set_runtime_options(const runtime_options& options) {
+        std::lock_guard<std::mutex> lock(context::mutex());
+        if (context::current().load(std::memory_order_relaxed) != nullptr)
+            throw std::runtime_error{"Runtime options must be set before the first op is executed"};
+
+        context::options() = options;
+    }
+
+    const runtime_options& get_runtime_options() {
+        return context::options();
+    }
+}
+
 #endif //CPPFLOW2_CONTEXT_H
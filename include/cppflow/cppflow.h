@@ -7,6 +7,12 @@
 #include <tensorflow/c/c_api.h>
 #include "tensor.h"
 #include "model.h"
+#include "batching.h"
+#include "model_pool.h"
+#include "executor.h"
+#include "profiler.h"
+#include "graph.h"
+#include "function.h"
 #include "raw_ops.h"
 #include "ops.h"
 #include "datatype.h"
@@ -0,0 +1,192 @@
+//
+// Bounded worker pool
+//
+
+#ifndef CPPFLOW2_EXECUTOR_H
+#define CPPFLOW2_EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace cppflow {
+
+    /**
+     * @struct executor_options
+     * @brief Size and queue limits of an executor
+     */
+    struct executor_options {
+        /// What post() does when the queue is full
+        enum class overflow { block, reject };
+
+        /// Worker threads
+        size_t threads = 1;
+
+        /// Maximum number of tasks waiting for a worker
+        size_t max_queue = 1024;
+
+        overflow on_full = overflow::block;
+    };
+
+    /**
+     * @class executor
+     * @brief A fixed set of worker threads fed by a bounded queue
+     *
+     * When the queue is full, producers are either blocked until a worker takes a task or get an
+     * error, so a burst of requests can not grow the queue without bound.
+     */
+    class executor {
+    public:
+        explicit executor(const executor_options& options = executor_options());
+
+        /**
+         * Runs the queued tasks and joins the workers
+         */
+        ~executor();
+
+        executor(const executor&)             = delete;
+        executor& operator=(const executor&)  = delete;
+
+        /**
+         * Queues a task, applying options.on_full if the queue is full
+         * @throws std::runtime_error If the queue is full and on_full is reject
+         */
+        void post(std::function<void()> task);
+
+        /**
+         * Queues a task unless the queue is full
+         * @return False if the task has not been queued
+         */
+        bool try_post(std::function<void()> task);
+
+        /**
+         * Queues a task, applying options.on_full if the queue is full
+         * @return The future result of f
+         */
+        template<typename F>
+        std::future<std::invoke_result_t<F>> submit(F f);
+
+        /**
+         * @return Number of tasks waiting for a worker
+         */
+        size_t queued() const;
+
+        /**
+         * @return Number of tasks rejected because the queue was full
+         */
+        uint64_t rejected() const;
+
+    private:
+        bool push(std::function<void()>& task, bool wait);
+        void work();
+
+        executor_options options_;
+
+        mutable std::mutex mutex_;
+        std::condition_variable not_empty_;
+        std::condition_variable not_full_;
+        std::deque<std::function<void()>> queue_;
+        bool stop_ = false;
+
+        std::atomic<uint64_t> rejected_{0};
+        std::vector<std::thread> workers_;
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    executor::executor(const executor_options& options) : options_(options) {
+        if (this->options_.threads == 0 || this->options_.max_queue == 0)
+            throw std::runtime_error{"An executor needs at least one thread and one queue slot"};
+
+        for (size_t i = 0; i < this->options_.threads; i++)
+            this->workers_.emplace_back(&executor::work, this);
+    }
+
+    executor::~executor() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->stop_ = true;
+        }
+        this->not_empty_.notify_all();
+        this->not_full_.notify_all();
+        for (auto& worker : this->workers_)
+            worker.join();
+    }
+
+    void executor::post(std::function<void()> task) {
+        if (!this->push(task, this->options_.on_full == executor_options::overflow::block))
+            throw std::runtime_error{"The executor queue is full"};
+    }
+
+    bool executor::try_post(std::function<void()> task) {
+        return this->push(task, false);
+    }
+
+    template<typename F>
+    std::future<std::invoke_result_t<F>> executor::submit(F f) {
+        // std::function needs a copyable callable
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::move(f));
+        auto result = task->get_future();
+        this->post([task]() { (*task)(); });
+        return result;
+    }
+
+    size_t executor::queued() const {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        return this->queue_.size();
+    }
+
+    uint64_t executor::rejected() const {
+        return this->rejected_.load(std::memory_order_relaxed);
+    }
+
+    bool executor::push(std::function<void()>& task, bool wait) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex_);
+            if (wait)
+                this->not_full_.wait(lock, [this] { return this->stop_ || this->queue_.size() < this->options_.max_queue; });
+
+            if (this->stop_)
+                throw std::runtime_error{"The executor is shutting down"};
+            if (this->queue_.size() >= this->options_.max_queue) {
+                this->rejected_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            this->queue_.push_back(std::move(task));
+        }
+        this->not_empty_.notify_one();
+        return true;
+    }
+
+    void executor::work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex_);
+                this->not_empty_.wait(lock, [this] { return this->stop_ || !this->queue_.empty(); });
+                if (this->queue_.empty())
+                    return; // Stopped and drained
+
+                task = std::move(this->queue_.front());
+                this->queue_.pop_front();
+            }
+            this->not_full_.notify_one();
+            task();
+        }
+    }
+}
+
+#endif //CPPFLOW2_EXECUTOR_H
@@ -0,0 +1,290 @@
+//
+// Eager code traced into runtime functions
+//
+
+#ifndef CPPFLOW2_FUNCTION_H
+#define CPPFLOW2_FUNCTION_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "graph.h"
+#include "raw_ops.h"
+#include "tensor.h"
+
+namespace cppflow {
+
+    /**
+     * @struct function_options
+     * @brief How a function is traced
+     */
+    struct function_options {
+        /// Prefix of the names the traces are registered under. Defaults to "cppflow_function"
+        std::string name;
+
+        /// Trace with the dimensions left unknown, so inputs of the same dtypes and ranks share a trace
+        bool relax_shapes = false;
+
+        /// Maximum number of traces kept. Calls with a new signature beyond it throw (0 is unlimited)
+        size_t max_traces = 0;
+    };
+
+    /**
+     * @struct function_stats
+     * @brief Calls and traces of a function
+     */
+    struct function_stats {
+        uint64_t calls = 0;
+
+        /// Number of times the body has been traced
+        uint64_t traces = 0;
+
+        /// Traces after the first one, each caused by a call with a new input signature or by a
+        /// restart of the runtime, which drops the traces registered with it
+        uint64_t retraces = 0;
+    };
+
+    /**
+     * @class function
+     * @brief A body over tensors traced into a graph once per input signature, then called as a single op
+     *
+     * The first call with a given list of input dtypes and shapes runs the body under a graph_builder,
+     * turns the recorded ops into a TF_Function and registers it with the eager runtime. That call and
+     * every later one with the same signature execute the function as one op, which runs the whole
+     * body in a single dispatch and lets Grappler optimize it.
+     *
+     * As with graph_builder, eager tensors the body uses without taking them as inputs are baked
+     * into the trace as constants. Called while a graph_builder records, it adds a call node instead.
+     */
+    class function {
+    public:
+        using body_type = std::function<std::vector<tensor>(const std::vector<tensor>&)>;
+
+        explicit function(body_type body, const function_options& options = function_options());
+
+        /**
+         * Removes the traces from the runtime they were registered with, if it is still running
+         */
+        ~function();
+
+        function(const function&)             = delete;
+        function& operator=(const function&)  = delete;
+
+        /**
+         * Calls the trace matching the inputs, tracing the body first if there is none
+         * @return The outputs of the body
+         * @throws std::runtime_error If a new trace is needed and options.max_traces is reached
+         */
+        std::vector<tensor> operator()(const std::vector<tensor>& inputs);
+
+        /**
+         * Traces the body for inputs of the given dtypes and shapes ahead of the first call
+         * @param shapes The shape of each input. Dimensions of -1 are unknown
+         */
+        void trace(const std::vector<datatype>& dtypes, const std::vector<std::vector<int64_t>>& shapes);
+
+        /**
+         * @return Number of traces kept, one per input signature seen
+         */
+        size_t num_traces() const;
+
+        function_stats stats() const;
+
+    private:
+        struct input_spec {
+            datatype dtype;
+
+            /// -1 for unknown rank
+            int rank;
+            std::vector<int64_t> dims;
+        };
+
+        static input_spec spec_of(const tensor& input);
+        static std::string key_of(const std::vector<input_spec>& specs);
+
+        std::shared_ptr<const graph_function> lookup(std::vector<input_spec> specs);
+        std::shared_ptr<const graph_function> compile(const std::vector<input_spec>& specs);
+
+        static std::atomic<uint64_t>& instances() {
+            static std::atomic<uint64_t> instances{0};
+            return instances;
+        }
+
+        body_type body_;
+        function_options options_;
+        std::string prefix_;
+
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<const graph_function>> traces_;
+
+        // Runtime the traces are registered with. They are dropped when it changes
+        uint64_t generation_ = 0;
+
+        std::atomic<uint64_t> calls_{0};
+        uint64_t traced_ = 0;
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    function::function(body_type body, const function_options& options) : body_(std::move(body)), options_(options) {
+        // Function names are global to the runtime
+        this->prefix_ = (options.name.empty() ? "cppflow_function" : options.name) + "_" +
+                        std::to_string(instances().fetch_add(1, std::memory_order_relaxed));
+    }
+
+    function::~function() {
+        if (!context::initialized() || context::current_generation() != this->generation_)
+            return;
+
+        std::unique_ptr<TF_Status, decltype(&TF_DeleteStatus)> status(TF_NewStatus(), TF_DeleteStatus);
+        for (auto& trace : this->traces_)
+            TFE_ContextRemoveFunction(context::get_context(), trace.second->name().c_str(), status.get());
+    }
+
+    std::vector<tensor> function::operator()(const std::vector<tensor>& inputs) {
+        this->calls_.fetch_add(1, std::memory_order_relaxed);
+
+        std::vector<input_spec> specs;
+        specs.reserve(inputs.size());
+        for (auto& input : inputs)
+            specs.push_back(spec_of(input));
+
+        return (*this->lookup(std::move(specs)))(inputs);
+    }
+
+    void function::trace(const std::vector<datatype>& dtypes, const std::vector<std::vector<int64_t>>& shapes) {
+        if (dtypes.size() != shapes.size())
+            throw std::runtime_error{"trace needs one shape per dtype"};
+
+        std::vector<input_spec> specs;
+        for (size_t i = 0; i < dtypes.size(); i++)
+            specs.push_back({dtypes[i], (int)shapes[i].size(), shapes[i]});
+        this->lookup(std::move(specs));
+    }
+
+    size_t function::num_traces() const {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        return this->traces_.size();
+    }
+
+    function_stats function::stats() const {
+        function_stats stats;
+        stats.calls = this->calls_.load(std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        stats.traces = this->traced_;
+        stats.retraces = this->traced_ > 0 ? this->traced_ - 1 : 0;
+        return stats;
+    }
+
+    function::input_spec function::spec_of(const tensor& input) {
+        input_spec spec{input.dtype(), -1, {}};
+
+        if (!input.symbolic()) {
+            auto dims = input.dims();
+            spec.rank = (int)dims.size();
+            spec.dims = dims.to_vector();
+            return spec;
+        }
+
+        // Symbolic inputs take the shape inferred in the graph being recorded
+        auto* builder = graph_builder::current();
+        if (builder == nullptr)
+            throw std::runtime_error{"A symbolic tensor can only be used while its graph_builder is recording"};
+
+        spec.rank = TF_GraphGetTensorNumDims(builder->graph(), input.tf_output, context::get_status());
+        status_check(context::get_status());
+        if (spec.rank > 0) {
+            spec.dims.resize(spec.rank);
+            TF_GraphGetTensorShape(builder->graph(), input.tf_output, spec.dims.data(), spec.rank, context::get_status());
+            status_check(context::get_status());
+        }
+        return spec;
+    }
+
+    std::string function::key_of(const std::vector<input_spec>& specs) {
+        std::string key;
+        for (auto& spec : specs) {
+            key += std::to_string((int)spec.dtype);
+            if (spec.rank < 0) {
+                key += "?";
+            } else {
+                key += "[";
+                for (auto dim : spec.dims)
+                    key += std::to_string(dim) + ",";
+                key += "]";
+            }
+            key += ";";
+        }
+        return key;
+    }
+
+    std::shared_ptr<const graph_function> function::lookup(std::vector<input_spec> specs) {
+        if (this->options_.relax_shapes) {
+            for (auto& spec : specs)
+                std::fill(spec.dims.begin(), spec.dims.end(), -1);
+        }
+        auto key = key_of(specs);
+
+        // Created first, so the generation does not change while tracing
+        context::get_context();
+
+        // Tracing is done under the lock, so concurrent first calls trace once
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        if (this->generation_ != context::current_generation()) {
+            // Registered with a runtime that has been shut down
+            this->traces_.clear();
+            this->generation_ = context::current_generation();
+        }
+
+        auto it = this->traces_.find(key);
+        if (it != this->traces_.end())
+            return it->second;
+
+        if (this->options_.max_traces != 0 && this->traces_.size() >= this->options_.max_traces)
+            throw std::runtime_error{"Function " + this->prefix_ + " reached its maximum number of traces with signature " + key};
+
+        auto traced = this->compile(specs);
+        this->traces_.emplace(key, traced);
+        return traced;
+    }
+
+    std::shared_ptr<const graph_function> function::compile(const std::vector<input_spec>& specs) {
+        graph_builder builder;
+        std::vector<tensor> inputs;
+        std::vector<tensor> outputs;
+        {
+            graph_builder::scope scope(builder);
+            for (auto& spec : specs) {
+                if (spec.rank < 0)
+                    inputs.push_back(builder.placeholder(spec.dtype));
+                else
+                    inputs.push_back(builder.placeholder(spec.dtype, spec.dims));
+            }
+            outputs = this->body_(inputs);
+
+            // Outputs that are inputs or eager values still need a node of their own in the body
+            for (auto& output : outputs)
+                output = identity(output);
+        }
+
+        auto name = this->prefix_ + "_" + std::to_string(this->traced_);
+        auto traced = std::make_shared<const graph_function>(builder.compile_function(name, inputs, outputs));
+        this->traced_++;
+        return traced;
+    }
+}
+
+#endif //CPPFLOW2_FUNCTION_H
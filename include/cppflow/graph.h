@@ -0,0 +1,673 @@
+//
+// Recording of op calls into a graph
+//
+
+#ifndef CPPFLOW2_GRAPH_H
+#define CPPFLOW2_GRAPH_H
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <tensorflow/c/c_api.h>
+#include <tensorflow/c/eager/c_api.h>
+
+#include "context.h"
+#include "datatype.h"
+#include "model.h"
+#include "tensor.h"
+
+namespace cppflow {
+
+    class graph_function;
+    class op_builder;
+
+    /**
+     * @class graph_builder
+     * @brief Records op calls into a TF_Graph instead of executing them
+     *
+     * While a graph_builder::scope is alive on a thread, the cppflow ops called from that thread add
+     * nodes to the graph and return symbolic tensors. The recorded chain is then compiled into a
+     * model, run with a single session call, or into a function called like one eager op. Either
+     * way the whole chain goes through Grappler, which can fold and fuse it.
+     *
+     * Eager tensors used as op inputs are captured as Const nodes: their value is baked into the graph.
+     *
+     * An op call that throws while its node is being described (a bad input or attribute) can leave an
+     * incomplete node in the graph. The builder is then failed: it refuses to compile.
+     */
+    class graph_builder {
+    public:
+        graph_builder();
+
+        graph_builder(const graph_builder&)             = delete;
+        graph_builder& operator=(const graph_builder&)  = delete;
+
+        /**
+         * @class scope
+         * @brief Makes a builder the one recording the ops of the calling thread until it goes out of scope
+         */
+        class scope {
+        public:
+            explicit scope(graph_builder& builder);
+            ~scope();
+
+            scope(const scope&)             = delete;
+            scope& operator=(const scope&)  = delete;
+
+        private:
+            graph_builder* previous_;
+        };
+
+        /**
+         * @return The builder recording the ops of the calling thread, or nullptr if ops run eagerly
+         */
+        static graph_builder* current();
+
+        /**
+         * Adds an input of unknown shape
+         * @param name Name of the node. Defaults to a unique "Placeholder" name
+         * @return The symbolic tensor of the input
+         */
+        tensor placeholder(datatype dtype, const std::string& name = "");
+
+        /**
+         * Adds an input of known shape. Dimensions of -1 are unknown
+         * @param name Name of the node. Defaults to a unique "Placeholder" name
+         * @return The symbolic tensor of the input
+         */
+        tensor placeholder(datatype dtype, const std::vector<int64_t>& shape, const std::string& name = "");
+
+        /**
+         * Adds a Const node holding the value of an eager tensor. Capturing the same tensor twice
+         * returns the same node
+         * @return The symbolic tensor of the constant
+         */
+        tensor capture(const tensor& value);
+
+        /**
+         * @return base if no node of the graph has this name yet, otherwise base followed by a number
+         */
+        std::string unique_name(const std::string& base);
+
+        /**
+         * @return The graph being built
+         */
+        TF_Graph* graph() const;
+
+        /**
+         * @return True if an op call failed while recording, see failure()
+         */
+        bool failed() const;
+
+        /**
+         * @return The op whose call failed while recording, empty if none did
+         */
+        const std::string& failure() const;
+
+        /**
+         * Creates a session over the graph
+         * @param inputs The placeholders fed by model::run, in order
+         * @param outputs The symbolic tensors returned by model::run, in order
+         * @param options Configuration of the session
+         * @throws std::runtime_error If the builder has failed
+         */
+        model compile(const std::vector<tensor>& inputs, const std::vector<tensor>& outputs,
+                      const model_options& options = model_options()) const;
+
+        /**
+         * Turns the nodes the outputs depend on into a function of the eager runtime
+         * @param name Name of the function. Must be unique in the runtime
+         * @param inputs The placeholders bound to the function arguments, in order
+         * @param outputs The symbolic tensors returned by the function, in order
+         * @throws std::runtime_error If the builder has failed
+         */
+        graph_function compile_function(const std::string& name, const std::vector<tensor>& inputs,
+                                        const std::vector<tensor>& outputs) const;
+
+    private:
+        friend class graph_function;
+        friend class op_builder;
+
+        static graph_builder*& current_builder();
+
+        static std::vector<TF_Output> outputs_of(const std::vector<tensor>& tensors, const char* what);
+
+        void check_not_failed() const;
+
+        void add_function(const graph_function& function);
+
+        std::shared_ptr<TF_Graph> graph_;
+        std::unordered_map<std::string, int> names_;
+
+        // Captured tensors are kept alive so their handles can not be reused by another tensor
+        std::unordered_map<TFE_TensorHandle*, TF_Output> captures_;
+        std::vector<tensor> captured_;
+
+        std::unordered_set<std::string> functions_;
+
+        // Set by an op_builder destroyed before its node was finished
+        std::string failure_;
+    };
+
+    /**
+     * @class graph_function
+     * @brief A function compiled by graph_builder::compile_function
+     *
+     * Calling it executes the whole function as a single eager op, or adds a call node when a
+     * graph_builder is recording.
+     */
+    class graph_function {
+    public:
+        graph_function(std::shared_ptr<TF_Function> function, std::string name, int num_outputs);
+
+        /**
+         * @return The name of the function in the runtime
+         */
+        const std::string& name() const;
+
+        /**
+         * @return Number of tensors returned by the function
+         */
+        int num_outputs() const;
+
+        /**
+         * Calls the function
+         * @return Its outputs, in order
+         */
+        std::vector<tensor> operator()(const std::vector<tensor>& inputs) const;
+
+    private:
+        friend class graph_builder;
+
+        std::shared_ptr<TF_Function> function_;
+        std::string name_;
+        int num_outputs_;
+    };
+
+    /**
+     * @class op_builder
+     * @brief Builds a call to an op or function, eagerly or into the current graph_builder
+     *
+     * The generated ops in raw_ops.h go through it, which is what lets a graph_builder record them.
+     */
+    class op_builder {
+    public:
+        /**
+         * @param op_name The name of the op or function. Must outlive the op_builder
+         * @param cache False to not keep the eager op in the per-thread cache (see cached_op)
+         */
+        explicit op_builder(const char* op_name, bool cache = true);
+
+        /**
+         * If execute() has not been called, finishes the node, ignoring errors, and marks the
+         * graph_builder as failed
+         */
+        ~op_builder();
+
+        op_builder(const op_builder&)             = delete;
+        op_builder& operator=(const op_builder&)  = delete;
+
+        /**
+         * @return True if the op is added to a graph instead of being executed
+         */
+        bool symbolic() const;
+
+        void add_input(const tensor& input);
+        void add_input_list(const std::vector<tensor>& inputs);
+
+        void set_attr_int(const char* name, int64_t value);
+        void set_attr_float(const char* name, float value);
+        void set_attr_bool(const char* name, bool value);
+        void set_attr_type(const char* name, datatype value);
+        void set_attr_string(const char* name, const std::string& value);
+        void set_attr_shape(const char* name, const std::vector<int64_t>& dims);
+        void set_attr_tensor(const char* name, const tensor& value);
+        void set_attr_int_list(const char* name, const std::vector<int64_t>& values);
+        void set_attr_float_list(const char* name, const std::vector<float>& values);
+        void set_attr_bool_list(const char* name, const std::vector<bool>& values);
+        void set_attr_type_list(const char* name, const std::vector<datatype>& values);
+        void set_attr_string_list(const char* name, const std::vector<std::string>& values);
+        void set_attr_shape_list(const char* name, const std::vector<std::vector<int64_t>>& shapes);
+
+        /**
+         * Executes the op, or finishes its node
+         * @return Its first output
+         */
+        tensor execute();
+
+        /**
+         * Executes the op, or finishes its node
+         * @return Its outputs
+         */
+        std::vector<tensor> execute(int num_outputs);
+
+    private:
+        TF_Operation* finish();
+
+        const char* op_name_;
+        graph_builder* builder_;
+        std::optional<cached_op> eager_;
+        TF_OperationDescription* desc_ = nullptr;
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    graph_builder::graph_builder() : graph_(TF_NewGraph(), TF_DeleteGraph) {}
+
+    graph_builder::scope::scope(graph_builder& builder) : previous_(current_builder()) {
+        current_builder() = &builder;
+    }
+
+    graph_builder::scope::~scope() {
+        current_builder() = this->previous_;
+    }
+
+    graph_builder* graph_builder::current() {
+        return current_builder();
+    }
+
+    graph_builder*& graph_builder::current_builder() {
+        thread_local graph_builder* builder = nullptr;
+        return builder;
+    }
+
+    tensor graph_builder::placeholder(datatype dtype, const std::string& name) {
+        auto node = this->unique_name(name.empty() ? "Placeholder" : name);
+        auto* desc = TF_NewOperation(this->graph_.get(), "Placeholder", node.c_str());
+        TF_SetAttrType(desc, "dtype", dtype);
+        auto* oper = TF_FinishOperation(desc, context::get_status());
+        status_check(context::get_status());
+
+        tensor result;
+        result.tf_output = {oper, 0};
+        return result;
+    }
+
+    tensor graph_builder::placeholder(datatype dtype, const std::vector<int64_t>& shape, const std::string& name) {
+        auto node = this->unique_name(name.empty() ? "Placeholder" : name);
+        auto* desc = TF_NewOperation(this->graph_.get(), "Placeholder", node.c_str());
+        TF_SetAttrType(desc, "dtype", dtype);
+        TF_SetAttrShape(desc, "shape", shape.data(), (int)shape.size());
+        auto* oper = TF_FinishOperation(desc, context::get_status());
+        status_check(context::get_status());
+
+        tensor result;
+        result.tf_output = {oper, 0};
+        return result;
+    }
+
+    tensor graph_builder::capture(const tensor& value) {
+        if (value.symbolic())
+            return value;
+
+        tensor result;
+        auto it = this->captures_.find(value.tfe_handle.get());
+        if (it != this->captures_.end()) {
+            result.tf_output = it->second;
+            return result;
+        }
+
+        auto node = this->unique_name("Const");
+        auto* desc = TF_NewOperation(this->graph_.get(), "Const", node.c_str());
+        TF_SetAttrTensor(desc, "value", value.get_tensor().get(), context::get_status());
+        status_check(context::get_status());
+        TF_SetAttrType(desc, "dtype", value.dtype());
+        auto* oper = TF_FinishOperation(desc, context::get_status());
+        status_check(context::get_status());
+
+        result.tf_output = {oper, 0};
+        this->captures_.emplace(value.tfe_handle.get(), result.tf_output);
+        this->captured_.push_back(value);
+        return result;
+    }
+
+    std::string graph_builder::unique_name(const std::string& base) {
+        // The counter also covers nodes whose description is not finished yet
+        auto& count = this->names_[base];
+        auto name = count == 0 ? base : base + "_" + std::to_string(count);
+        while (TF_GraphOperationByName(this->graph_.get(), name.c_str()) != nullptr)
+            name = base + "_" + std::to_string(++count);
+        count++;
+        return name;
+    }
+
+    TF_Graph* graph_builder::graph() const {
+        return this->graph_.get();
+    }
+
+    bool graph_builder::failed() const {
+        return !this->failure_.empty();
+    }
+
+    const std::string& graph_builder::failure() const {
+        return this->failure_;
+    }
+
+    void graph_builder::check_not_failed() const {
+        if (this->failed())
+            throw std::runtime_error{"The graph can not be compiled, a call to " + this->failure_ + " failed while recording"};
+    }
+
+    model graph_builder::compile(const std::vector<tensor>& inputs, const std::vector<tensor>& outputs,
+                                 const model_options& options) const {
+        this->check_not_failed();
+        return model(this->graph_, outputs_of(inputs, "inputs"), outputs_of(outputs, "outputs"), options);
+    }
+
+    graph_function graph_builder::compile_function(const std::string& name, const std::vector<tensor>& inputs,
+                                                   const std::vector<tensor>& outputs) const {
+        this->check_not_failed();
+        auto input_outputs = outputs_of(inputs, "inputs");
+        auto output_outputs = outputs_of(outputs, "outputs");
+
+        // The body is made of the nodes the outputs depend on, so unrelated recordings are left out
+        std::unordered_set<TF_Operation*> visited;
+        std::vector<const TF_Operation*> body;
+        std::vector<TF_Operation*> pending;
+        for (auto& input : input_outputs) {
+            if (visited.insert(input.oper).second)
+                body.push_back(input.oper);
+        }
+        for (auto& output : output_outputs)
+            pending.push_back(output.oper);
+
+        while (!pending.empty()) {
+            auto* oper = pending.back();
+            pending.pop_back();
+            if (!visited.insert(oper).second)
+                continue;
+            body.push_back(oper);
+
+            for (int i = 0; i < TF_OperationNumInputs(oper); i++)
+                pending.push_back(TF_OperationInput({oper, i}).oper);
+
+            std::vector<TF_Operation*> controls(TF_OperationNumControlInputs(oper));
+            TF_OperationGetControlInputs(oper, controls.data(), (int)controls.size());
+            pending.insert(pending.end(), controls.begin(), controls.end());
+        }
+
+        auto* function = TF_GraphToFunction(this->graph_.get(), name.c_str(), 0, (int)body.size(), body.data(),
+                                            (int)input_outputs.size(), input_outputs.data(),
+                                            (int)output_outputs.size(), output_outputs.data(),
+                                            nullptr, nullptr, nullptr, context::get_status());
+        status_check(context::get_status());
+        std::shared_ptr<TF_Function> owned(function, TF_DeleteFunction);
+
+        TFE_ContextAddFunction(context::get_context(), function, context::get_status());
+        status_check(context::get_status());
+
+        return graph_function(owned, name, (int)output_outputs.size());
+    }
+
+    std::vector<TF_Output> graph_builder::outputs_of(const std::vector<tensor>& tensors, const char* what) {
+        std::vector<TF_Output> outputs;
+        outputs.reserve(tensors.size());
+        for (auto& t : tensors) {
+            if (!t.symbolic())
+                throw std::runtime_error{std::string("The ") + what + " of a compiled graph must be symbolic tensors"};
+            outputs.push_back(t.tf_output);
+        }
+        return outputs;
+    }
+
+    void graph_builder::add_function(const graph_function& function) {
+        if (this->functions_.count(function.name_) != 0)
+            return;
+
+        TF_GraphCopyFunction(this->graph_.get(), function.function_.get(), nullptr, context::get_status());
+        status_check(context::get_status());
+        this->functions_.insert(function.name_);
+    }
+
+    graph_function::graph_function(std::shared_ptr<TF_Function> function, std::string name, int num_outputs)
+        : function_(std::move(function)), name_(std::move(name)), num_outputs_(num_outputs) {}
+
+    const std::string& graph_function::name() const {
+        return this->name_;
+    }
+
+    int graph_function::num_outputs() const {
+        return this->num_outputs_;
+    }
+
+    std::vector<tensor> graph_function::operator()(const std::vector<tensor>& inputs) const {
+        if (auto* builder = graph_builder::current())
+            builder->add_function(*this);
+
+        // Not cached, as the function may be removed from the runtime while the thread lives
+        op_builder op(this->name_.c_str(), false);
+        for (auto& input : inputs)
+            op.add_input(input);
+        return op.execute(this->num_outputs_);
+    }
+
+    op_builder::op_builder(const char* op_name, bool cache) : op_name_(op_name), builder_(graph_builder::current()) {
+        if (this->builder_ == nullptr) {
+            this->eager_.emplace(op_name, cache);
+            return;
+        }
+
+        auto name = this->builder_->unique_name(op_name);
+        this->desc_ = TF_NewOperation(this->builder_->graph(), op_name, name.c_str());
+    }
+
+    op_builder::~op_builder() {
+        // A description can only be released by finishing it, which may add an incomplete node
+        if (this->desc_ != nullptr) {
+            std::unique_ptr<TF_Status, decltype(&TF_DeleteStatus)> status(TF_NewStatus(), TF_DeleteStatus);
+            TF_FinishOperation(this->desc_, status.get());
+            if (this->builder_->failure_.empty())
+                this->builder_->failure_ = this->op_name_;
+        }
+    }
+
+    bool op_builder::symbolic() const {
+        return this->builder_ != nullptr;
+    }
+
+    void op_builder::add_input(const tensor& input) {
+        if (this->symbolic()) {
+            TF_AddInput(this->desc_, this->builder_->capture(input).tf_output);
+            return;
+        }
+
+        if (input.symbolic())
+            throw std::runtime_error{"A symbolic tensor can only be used while its graph_builder is recording"};
+        TFE_OpAddInput(*this->eager_, input.tfe_handle.get(), context::get_status());
+        status_check(context::get_status());
+    }
+
+    void op_builder::add_input_list(const std::vector<tensor>& inputs) {
+        if (this->symbolic()) {
+            std::vector<TF_Output> outputs;
+            outputs.reserve(inputs.size());
+            for (auto& input : inputs)
+                outputs.push_back(this->builder_->capture(input).tf_output);
+            TF_AddInputList(this->desc_, outputs.data(), (int)outputs.size());
+            return;
+        }
+
+        std::vector<TFE_TensorHandle*> handles;
+        handles.reserve(inputs.size());
+        for (auto& input : inputs) {
+            if (input.symbolic())
+                throw std::runtime_error{"A symbolic tensor can only be used while its graph_builder is recording"};
+            handles.push_back(input.tfe_handle.get());
+        }
+        TFE_OpAddInputList(*this->eager_, handles.data(), (int)handles.size(), context::get_status());
+        status_check(context::get_status());
+    }
+
+    void op_builder::set_attr_int(const char* name, int64_t value) {
+        if (this->symbolic())
+            TF_SetAttrInt(this->desc_, name, value);
+        else
+            TFE_OpSetAttrInt(*this->eager_, name, value);
+    }
+
+    void op_builder::set_attr_float(const char* name, float value) {
+        if (this->symbolic())
+            TF_SetAttrFloat(this->desc_, name, value);
+        else
+            TFE_OpSetAttrFloat(*this->eager_, name, value);
+    }
+
+    void op_builder::set_attr_bool(const char* name, bool value) {
+        if (this->symbolic())
+            TF_SetAttrBool(this->desc_, name, (unsigned char)value);
+        else
+            TFE_OpSetAttrBool(*this->eager_, name, (unsigned char)value);
+    }
+
+    void op_builder::set_attr_type(const char* name, datatype value) {
+        if (this->symbolic())
+            TF_SetAttrType(this->desc_, name, value);
+        else
+            TFE_OpSetAttrType(*this->eager_, name, value);
+    }
+
+    void op_builder::set_attr_string(const char* name, const std::string& value) {
+        if (this->symbolic())
+            TF_SetAttrString(this->desc_, name, value.data(), value.size());
+        else
+            TFE_OpSetAttrString(*this->eager_, name, value.data(), value.size());
+    }
+
+    void op_builder::set_attr_shape(const char* name, const std::vector<int64_t>& dims) {
+        if (this->symbolic()) {
+            TF_SetAttrShape(this->desc_, name, dims.data(), (int)dims.size());
+            return;
+        }
+
+        TFE_OpSetAttrShape(*this->eager_, name, dims.data(), (int)dims.size(), context::get_status());
+        status_check(context::get_status());
+    }
+
+    void op_builder::set_attr_tensor(const char* name, const tensor& value) {
+        if (this->symbolic())
+            TF_SetAttrTensor(this->desc_, name, value.get_tensor().get(), context::get_status());
+        else
+            TFE_OpSetAttrTensor(*this->eager_, name, value.get_tensor().get(), context::get_status());
+        status_check(context::get_status());
+    }
+
+    void op_builder::set_attr_int_list(const char* name, const std::vector<int64_t>& values) {
+        if (this->symbolic())
+            TF_SetAttrIntList(this->desc_, name, values.data(), (int)values.size());
+        else
+            TFE_OpSetAttrIntList(*this->eager_, name, values.data(), (int)values.size());
+    }
+
+    void op_builder::set_attr_float_list(const char* name, const std::vector<float>& values) {
+        if (this->symbolic())
+            TF_SetAttrFloatList(this->desc_, name, values.data(), (int)values.size());
+        else
+            TFE_OpSetAttrFloatList(*this->eager_, name, values.data(), (int)values.size());
+    }
+
+    void op_builder::set_attr_bool_list(const char* name, const std::vector<bool>& values) {
+        std::vector<unsigned char> bytes(values.begin(), values.end());
+        if (this->symbolic())
+            TF_SetAttrBoolList(this->desc_, name, bytes.data(), (int)bytes.size());
+        else
+            TFE_OpSetAttrBoolList(*this->eager_, name, bytes.data(), (int)bytes.size());
+    }
+
+    void op_builder::set_attr_type_list(const char* name, const std::vector<datatype>& values) {
+        if (this->symbolic())
+            TF_SetAttrTypeList(this->desc_, name, values.data(), (int)values.size());
+        else
+            TFE_OpSetAttrTypeList(*this->eager_, name, values.data(), (int)values.size());
+    }
+
+    void op_builder::set_attr_string_list(const char* name, const std::vector<std::string>& values) {
+        std::vector<const void*> data;
+        std::vector<size_t> sizes;
+        data.reserve(values.size());
+        sizes.reserve(values.size());
+        for (auto& value : values) {
+            data.push_back(value.data());
+            sizes.push_back(value.size());
+        }
+
+        if (this->symbolic())
+            TF_SetAttrStringList(this->desc_, name, data.data(), sizes.data(), (int)values.size());
+        else
+            TFE_OpSetAttrStringList(*this->eager_, name, data.data(), sizes.data(), (int)values.size());
+    }
+
+    void op_builder::set_attr_shape_list(const char* name, const std::vector<std::vector<int64_t>>& shapes) {
+        std::vector<const int64_t*> dims;
+        std::vector<int> num_dims;
+        dims.reserve(shapes.size());
+        num_dims.reserve(shapes.size());
+        for (auto& shape : shapes) {
+            dims.push_back(shape.data());
+            num_dims.push_back((int)shape.size());
+        }
+
+        if (this->symbolic()) {
+            TF_SetAttrShapeList(this->desc_, name, dims.data(), num_dims.data(), (int)shapes.size());
+            return;
+        }
+
+        TFE_OpSetAttrShapeList(*this->eager_, name, dims.data(), num_dims.data(), (int)shapes.size(), context::get_status());
+        status_check(context::get_status());
+    }
+
+    tensor op_builder::execute() {
+        if (this->symbolic()) {
+            tensor result;
+            result.tf_output = {this->finish(), 0};
+            return result;
+        }
+
+        int num_outputs = 1;
+        TFE_TensorHandle* res[1] = {nullptr};
+        TFE_Execute(*this->eager_, res, &num_outputs, context::get_status());
+        status_check(context::get_status());
+        return tensor(res[0]);
+    }
+
+    std::vector<tensor> op_builder::execute(int num_outputs) {
+        std::vector<tensor> results;
+
+        if (this->symbolic()) {
+            auto* oper = this->finish();
+            num_outputs = std::min(num_outputs, TF_OperationNumOutputs(oper));
+            results.resize(num_outputs);
+            for (int i = 0; i < num_outputs; i++)
+                results[i].tf_output = {oper, i};
+            return results;
+        }
+
+        std::vector<TFE_TensorHandle*> res(num_outputs, nullptr);
+        TFE_Execute(*this->eager_, res.data(), &num_outputs, context::get_status());
+        status_check(context::get_status());
+        results.reserve(num_outputs);
+        for (int i = 0; i < num_outputs; i++)
+            results.emplace_back(res[i]);
+        return results;
+    }
+
+    TF_Operation* op_builder::finish() {
+        auto* desc = this->desc_;
+        this->desc_ = nullptr;
+        auto* oper = TF_FinishOperation(desc, context::get_status());
+        status_check(context::get_status());
+        return oper;
+    }
+}
+
+#endif //CPPFLOW2_GRAPH_H
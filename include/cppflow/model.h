@@ -6,34 +6,287 @@
 #define CPPFLOW2_MODEL_H
 
 #include <tensorflow/c/c_api.h>
+#include <tensorflow/c/c_api_experimental.h>
 #include <string>
 #include <fstream>
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "context.h"
+#include "executor.h"
+#include "profiler.h"
+#include "proto.h"
 #include "tensor.h"
 
 namespace cppflow {
 
+	/**
+	 * @struct model_options
+	 * @brief Session configuration of a model, applied when it is loaded
+	 */
+	struct model_options {
+		/// State of a Grappler optimizer, default_value lets TensorFlow decide
+		enum class toggle { default_value, on, off };
+
+		/// XLA auto-clustering level (OptimizerOptions::GlobalJitLevel)
+		enum class jit_level { off = -1, default_value = 0, on_1 = 1, on_2 = 2 };
+
+		/// Threads used to parallelize a single op (0 lets TensorFlow pick one per core)
+		int intra_op_threads = 0;
+
+		/// Threads used to run independent ops concurrently (0 lets TensorFlow pick one per core)
+		int inter_op_threads = 0;
+
+		/// Create thread pools owned by this session instead of using the process-wide ones
+		bool use_per_session_threads = false;
+
+		/// Sizes of inter-op thread pools owned by the session. The first one is used by default
+		std::vector<int> session_inter_op_thread_pools;
+
+		/// Grappler optimizers (RewriterConfig)
+		struct grappler_options {
+			toggle layout_optimizer = toggle::default_value;
+			toggle constant_folding = toggle::default_value;
+			toggle shape_optimization = toggle::default_value;
+			toggle remapping = toggle::default_value;
+			toggle arithmetic_optimization = toggle::default_value;
+			toggle dependency_optimization = toggle::default_value;
+			toggle loop_optimization = toggle::default_value;
+			toggle function_optimization = toggle::default_value;
+			toggle debug_stripper = toggle::default_value;
+			toggle scoped_allocator_optimization = toggle::default_value;
+			toggle pin_to_host_optimization = toggle::default_value;
+			toggle implementation_selector = toggle::default_value;
+			toggle auto_mixed_precision = toggle::default_value;
+
+			/// Keep nodes that do not contribute to the fetched outputs
+			bool disable_model_pruning = false;
+
+			/// Turn off Grappler entirely
+			bool disable_meta_optimizer = false;
+		} grappler;
+
+		/// XLA JIT compilation. Any level above default_value also enables clustering of CPU ops
+		/// (a process-wide TensorFlow flag, shared by every session)
+		jit_level xla_jit = jit_level::default_value;
+
+		/// Serialized ConfigProto. The fields above override its values when set
+		std::string config;
+
+		/// SavedModel tags of the MetaGraph to load
+		std::vector<std::string> tags = { "serve" };
+
+		/// Operations resolved when the model is loaded, to be run by model::run_targets()
+		std::vector<std::string> targets;
+
+		/// SignatureDef bound to operator() when the model is created without explicit input/output names
+		std::string signature = "serving_default";
+
+		/// Worker pool running run_async(), created on the first asynchronous run
+		executor_options executor;
+
+		/// Kind of file given to the model constructors
+		enum class file_format { saved_model, graph_def };
+
+		/// A SavedModel directory, or a frozen GraphDef file (variables converted to constants). Frozen
+		/// graphs have no signatures, so their inputs and outputs must be given by name
+		file_format format = file_format::saved_model;
+
+		/// Map the GraphDef file in memory and import it from the mapping, instead of reading it
+		/// into a buffer first
+		bool map_graph_def = true;
+
+		/**
+		 * @return The serialized ConfigProto resulting from merging config with the fields above
+		 */
+		std::string serialize_config() const;
+	};
+
+	/**
+	 * @class cancellation_token
+	 * @brief Lets another thread abandon runs of a model
+	 *
+	 * A run that has not started yet is skipped. TF_SessionRun itself can not be interrupted, so a run
+	 * cancelled while in flight completes in the background: its result is discarded and an
+	 * asynchronous run fails immediately. Use run_options::timeout_ms to bound the run itself.
+	 */
+	class cancellation_token
+	{
+	public:
+		cancellation_token() = default;
+		cancellation_token(const cancellation_token&) = delete;
+		cancellation_token& operator=(const cancellation_token&) = delete;
+
+		/**
+		 * Cancels the runs using this token, calling the registered callbacks
+		 */
+		void cancel();
+
+		bool cancelled() const;
+
+		/**
+		 * Registers f to be called on cancel(), or calls it now if the token is already cancelled
+		 * @return An id to pass to unsubscribe()
+		 */
+		size_t subscribe(std::function<void()> f);
+
+		void unsubscribe(size_t id);
+
+	private:
+		std::atomic<bool> cancelled_{ false };
+		std::mutex mutex_;
+		size_t next_id_ = 0;
+		std::vector<std::pair<size_t, std::function<void()>>> callbacks_;
+	};
+
+	/**
+	 * @struct run_options
+	 * @brief Per-run settings of a session call
+	 */
+	struct run_options {
+		/// Fail the run with TF_DEADLINE_EXCEEDED after this time. 0 waits forever
+		int64_t timeout_ms = 0;
+
+		/// Cancels the run when cancelled, may be null
+		std::shared_ptr<cancellation_token> cancellation;
+
+		/**
+		 * @return The serialized RunOptions, empty if every field has its default value
+		 */
+		std::string serialize() const;
+	};
+
 	class model {
 	public:
+		/**
+		 * @struct tensor_info
+		 * @brief An input or output of a signature
+		 */
+		struct tensor_info {
+			/// Name of the input/output in the signature
+			std::string key;
+
+			/// Name of the graph tensor, as "operation:index"
+			std::string name;
+
+			datatype dtype;
+
+			/// Dimensions, -1 for the unknown ones. Empty if the rank is unknown too
+			std::vector<int64_t> shape;
+
+			bool unknown_rank;
+
+			/// The graph tensor, resolved when the model is loaded. Null for sparse and composite tensors,
+			/// which have no single graph tensor, and for names missing from the graph
+			TF_Output output;
+		};
+
+		/**
+		 * @struct signature
+		 * @brief A SignatureDef of the MetaGraph, with inputs and outputs sorted by key
+		 */
+		struct signature {
+			std::string name;
+			std::string method_name;
+			std::vector<tensor_info> inputs;
+			std::vector<tensor_info> outputs;
+
+			/// Graph tensors of inputs and outputs, in the same order, ready to be passed to TF_SessionRun
+			std::vector<TF_Output> feeds;
+			std::vector<TF_Output> fetches;
+
+			/// Why the signature can not be run, empty if it can
+			std::string unresolved;
+		};
+
+		/**
+		 * @struct output_info
+		 * @brief Static metadata of an output of a graph operation
+		 */
+		struct output_info {
+			datatype dtype;
+
+			/// Number of dimensions, -1 if unknown
+			int32_t n_dims;
+
+			/// Dimensions, -1 for the unknown ones
+			std::vector<int64_t> shape;
+		};
+
+		/**
+		 * @struct node_info
+		 * @brief Static metadata of a graph operation, read once
+		 */
+		struct node_info {
+			TF_Operation* op;
+			std::string name;
+			std::string type;
+			std::vector<output_info> outputs;
+		};
+
 		class operation
 		{
 		public:
 			operation(TF_Graph* graph, TF_Operation* op);
-			const std::string& name();
-			const int32_t dimention();
-			const std::vector<int64_t>& shape();
+			explicit operation(std::shared_ptr<const node_info> node);
+
+			const std::string& name() const;
+
+			/**
+			 * @return The op type (MatMul, Placeholder...)
+			 */
+			const std::string& type() const;
+
+			/**
+			 * @return Number of dimensions of the first output, 0 if there is no output
+			 */
+			const int32_t dimention() const;
+
+			/**
+			 * @return Shape of the first output, empty if there is no output
+			 */
+			const std::vector<int64_t>& shape() const;
+
+			int num_outputs() const;
+
+			const output_info& output(int i) const;
+
+			TF_Operation* get() const;
 
 		private:
-			std::string name_;
-			int32_t n_dims_;
-			TF_Operation* op_;
-			std::vector<int64_t> shape_;
+			friend class model;
+
+			static node_info read(TF_Graph* graph, TF_Operation* op);
+
+			std::shared_ptr<const node_info> node_;
 		};
 
+		/**
+		 * @class operations
+		 * @brief The operations of the graph of a model
+		 *
+		 * Backed by an index of the graph built on the first use and shared by the copies of the model,
+		 * so find() is a hash lookup and the metadata of the operations is only read once. The index is
+		 * rebuilt when operations have been added to the graph since it was built.
+		 */
 		class operations
 		{
 		public:
@@ -41,16 +294,15 @@ namespace cppflow {
 			{
 			public:
 				iterator() = default;
-				iterator(TF_Graph* graph, size_t pos);
+				iterator(std::shared_ptr<const std::vector<node_info>> nodes, size_t pos);
 				iterator operator++();
 				operation operator*();
 				bool operator!=(const iterator& iter);
 				bool operator==(const iterator& iter);
 
 			private:
-				TF_Graph* graph_;
+				std::shared_ptr<const std::vector<node_info>> nodes_;
 				size_t pos_;
-				TF_Operation* op_;
 			};
 
 			operations(model* _model);
@@ -59,229 +311,1819 @@ namespace cppflow {
 			iterator end();
 			iterator find(const char* op);
 
+			size_t size() const;
+
 		private:
-			TF_Graph* graph_;
+			std::shared_ptr<const std::vector<node_info>> nodes_;
+			std::shared_ptr<const std::unordered_map<std::string, size_t>> by_name_;
 		};
 
+		/**
+		 * Loads a SavedModel, binding the given graph tensors as inputs and outputs
+		 * @param inputs, outputs Tensor names, as "operation:index" or "operation" for the first output
+		 */
 		explicit model(const std::string& filename
 			, const std::vector<std::string>& inputs = { "serving_default_input_1" }
-			, const std::vector<std::string>& outputs = { "StatefulPartitionedCall" });
+			, const std::vector<std::string>& outputs = { "StatefulPartitionedCall" }
+			, const model_options& options = model_options());
+
+		/**
+		 * Loads a SavedModel, binding the inputs and outputs of the signature options.signature
+		 */
+		model(const std::string& filename, const model_options& options);
+
+		/**
+		 * Creates a session over a graph built in memory (see graph_builder::compile)
+		 * @param inputs, outputs The graph tensors bound to the model inputs and outputs
+		 * @param options Configuration of the session. Tags, signature and format are ignored
+		 */
+		model(std::shared_ptr<TF_Graph> graph, const std::vector<TF_Output>& inputs, const std::vector<TF_Output>& outputs,
+			  const model_options& options = model_options());
 
+		model(const model&) = default;
+		model(model&&) = default;
+		model& operator=(const model&) = default;
+		model& operator=(model&&) = default;
+
+		/**
+		 * Waits for the pending run_async calls
+		 */
+		~model();
+
+		/**
+		 * @class output_set
+		 * @brief The outputs of a run, accessible by position or by name
+		 *
+		 * Sized once for the outputs of a model by make_output_set(). Passing the same output_set to
+		 * every run() reuses its storage.
+		 */
+		class output_set
+		{
+		public:
+			output_set() = default;
+
+			size_t size() const;
+
+			const tensor& operator[](size_t i) const;
+
+			/**
+			 * @return The output called name (the signature key, or the name given at construction)
+			 * @throws std::runtime_error If there is no such output
+			 */
+			const tensor& operator[](const std::string& name) const;
+
+			/**
+			 * @return The names of the outputs, in order
+			 */
+			const std::vector<std::string>& names() const;
+
+			std::vector<tensor>::const_iterator begin() const { return values_.begin(); }
+			std::vector<tensor>::const_iterator end() const { return values_.end(); }
+
+		private:
+			friend class model;
+
+			std::shared_ptr<const std::vector<std::string>> names_;
+			std::vector<tensor> values_;
+			std::vector<TF_Tensor*> outvals_;
+		};
+
+		/**
+		 * @class prepared_call
+		 * @brief A run of the model bound once to fixed inputs and outputs
+		 *
+		 * Owns one preallocated input tensor per input and the fetch arrays passed to TF_SessionRun, so
+		 * a call only fills the input buffers (or binds existing tensors) and runs. Created with
+		 * model::prepare(), it must not outlive its model. An output that forwards an input (e.g.
+		 * through Identity) may share its buffer, so inputs must not be rewritten while such an
+		 * output is in use.
+		 */
+		class prepared_call
+		{
+		public:
+			prepared_call(prepared_call&&) = default;
+			prepared_call& operator=(prepared_call&&) = default;
+			prepared_call(const prepared_call&) = delete;
+			prepared_call& operator=(const prepared_call&) = delete;
+			~prepared_call();
+
+			size_t num_inputs() const { return feeds_.size(); }
+			size_t num_outputs() const { return fetches_.size(); }
+
+			/**
+			 * @return The preallocated buffer of input i, to be filled before run(). Binds it back
+			 * if an external tensor was set with set_input()
+			 * @throws std::runtime_error If T does not match the input datatype, or no shape was given for it
+			 */
+			template<typename T>
+			T* input(size_t i);
+
+			/**
+			 * Untyped version of input()
+			 * @return The preallocated buffer of input i, of input_dtype(i) elements
+			 */
+			void* input_data(size_t i);
+
+			/**
+			 * @return The datatype the graph expects for input i
+			 */
+			datatype input_dtype(size_t i) const;
+
+			/**
+			 * Feeds value to input i instead of the preallocated buffer, without copying it
+			 */
+			void set_input(size_t i, const tensor& value);
+
+			/**
+			 * Runs the model. The outputs of the previous run are released
+			 */
+			void run();
+
+			/**
+			 * @return A view over output i of the last run, valid until the next run
+			 */
+			template<typename T>
+			tensor_view<const T> output(size_t i) const;
+
+			/**
+			 * Takes the ownership of output i of the last run
+			 */
+			tensor take_output(size_t i);
+
+		private:
+			friend class model;
+
+			prepared_call(model* owner, std::vector<TF_Output> feeds, std::vector<TF_Output> fetches,
+						  const std::vector<std::vector<int64_t>>& input_shapes);
+
+			void release_outputs();
+
+			model* model_;
+			std::vector<TF_Output> feeds_;
+			std::vector<TF_Output> fetches_;
+			std::vector<std::shared_ptr<TF_Tensor>> buffers_;
+			std::vector<std::shared_ptr<TF_Tensor>> bound_;
+			std::vector<TF_Tensor*> input_values_;
+			std::vector<TF_Tensor*> output_values_;
+		};
+
+		/**
+		 * Binds the model inputs and outputs once for repeated runs
+		 * @param input_shapes Shape of each input, used to preallocate its buffer. Inputs without a
+		 * shape (or all of them if empty) must be given with prepared_call::set_input()
+		 */
+		prepared_call prepare(const std::vector<std::vector<int64_t>>& input_shapes = {});
+
+		/**
+		 * Binds the inputs and outputs of a signature once for repeated runs
+		 */
+		prepared_call prepare_signature(const signature& sig, const std::vector<std::vector<int64_t>>& input_shapes = {});
+
+		/**
+		 * Runs the model and returns its first output
+		 */
 		tensor operator()(const tensor& input);
+
+		/**
+		 * Runs the model and returns its first output
+		 */
 		tensor operator()(const std::vector<tensor>& inputs);
+
+		/**
+		 * Runs the model and appends all its outputs to outputs. To reuse the storage of a previous
+		 * run instead, use run() with an output_set
+		 */
 		void operator()(const std::vector<tensor>& inputs, std::vector<tensor>& outputs);
 
+		/**
+		 * @return An output_set sized for the outputs of the model
+		 */
+		output_set make_output_set() const;
+
+		/**
+		 * Runs the model
+		 * @return All the outputs of the model
+		 */
+		output_set run(const std::vector<tensor>& inputs);
+
+		/**
+		 * Runs the model, storing all its outputs in outputs. No allocation is made for the output set
+		 * when it comes from make_output_set()
+		 */
+		void run(const std::vector<tensor>& inputs, output_set& outputs);
+
+		/**
+		 * @return The signatures found in the MetaGraph, sorted by name
+		 */
+		const std::vector<signature>& signatures() const;
+
+		/**
+		 * @return The signature called name
+		 * @throws std::runtime_error If there is no such signature, or if it can not be run (see signature::unresolved)
+		 */
+		const signature& get_signature(const std::string& name) const;
+
+		/**
+		 * Runs a signature of the model
+		 * @param sig A signature of this model
+		 * @param inputs The values of sig.inputs, in the same order
+		 * @return The values of sig.outputs, in the same order
+		 */
+		std::vector<tensor> run(const signature& sig, const std::vector<tensor>& inputs);
+
+		/**
+		 * Runs the model on its worker pool. When the pool queue is full, the call blocks or throws
+		 * depending on model_options::executor. Pending runs complete before the model is destroyed
+		 * @return The future outputs of the model
+		 */
+		std::future<output_set> run_async(std::vector<tensor> inputs);
+
+		/**
+		 * Runs the model on its worker pool, then calls done from the worker thread with the outputs,
+		 * or with the exception thrown by the run. done must not throw
+		 */
+		void run_async(std::vector<tensor> inputs, std::function<void(output_set outputs, std::exception_ptr error)> done);
+
+		/**
+		 * Runs the model with a timeout and/or a cancellation token
+		 * @throws std::runtime_error If the run is cancelled or exceeds its deadline
+		 */
+		output_set run(const std::vector<tensor>& inputs, const run_options& options);
+
+		/**
+		 * Runs the model on its worker pool with a timeout and/or a cancellation token. The future
+		 * fails as soon as the token is cancelled, even if the run is in flight
+		 */
+		std::future<output_set> run_async(std::vector<tensor> inputs, run_options options);
+
+		/**
+		 * @struct run_stats
+		 * @brief Counters of the runs of a model (replicas have their own)
+		 */
+		struct run_stats {
+			uint64_t runs = 0;
+
+			/// Runs that failed because they exceeded run_options::timeout_ms
+			uint64_t deadline_exceeded = 0;
+
+			/// Runs cancelled with a cancellation_token, before or while running
+			uint64_t cancelled = 0;
+		};
+
+		/**
+		 * @return A snapshot of the run counters
+		 */
+		run_stats stats() const;
+
+		/**
+		 * @struct load_stats
+		 * @brief Where the time to get a model ready went, in milliseconds
+		 */
+		struct load_stats {
+			/// Reading or mapping the GraphDef file
+			double read_ms = 0;
+
+			/// Building the graph. For a SavedModel, the whole TF_LoadSessionFromSavedModel call,
+			/// which also creates the session and restores the variables
+			double import_ms = 0;
+
+			/// Creating the session of a GraphDef or a replica
+			double session_ms = 0;
+
+			/// Restoring the variables of a replica
+			double restore_ms = 0;
+
+			/// Parsing the signatures of the MetaGraphDef
+			double parse_ms = 0;
+
+			/// The first run, which instantiates the kernels. 0 until it happens
+			double first_run_ms = 0;
+		};
+
+		/**
+		 * @return The time spent loading the model, and in its first run
+		 */
+		load_stats get_load_stats() const;
+
+		/**
+		 * Runs the model on zero-filled inputs shaped after the graph inputs, so the first real requests
+		 * do not pay for graph optimization, kernel instantiation and memory growth. Marks the model ready
+		 * @param batch_sizes Sizes given to the unknown leading dimension of the inputs, other unknown
+		 * dimensions are set to 1
+		 * @param iterations Runs per batch size
+		 * @throws std::runtime_error If an input has an unknown rank or is a string
+		 */
+		void warmup(const std::vector<int64_t>& batch_sizes = { 1 }, int iterations = 3);
+
+		/**
+		 * Runs the model on recorded requests, for inputs that can not be synthesized. Marks the model ready
+		 * @param requests The inputs of each run
+		 * @param iterations Runs per request
+		 */
+		void warmup(const std::vector<std::vector<tensor>>& requests, int iterations = 1);
+
+		/**
+		 * @return True once warmup() has completed
+		 */
+		bool ready() const;
+
+		/**
+		 * @param names Tensor names, as "operation:index" or "operation" for the first output
+		 * @return The graph tensors, to be fed to run_targets()
+		 * @throws std::runtime_error If a tensor does not exist
+		 */
+		std::vector<TF_Output> resolve_outputs(const std::vector<std::string>& names) const;
+
+		/**
+		 * @param names Operation names
+		 * @return The operations, to be run as targets
+		 * @throws std::runtime_error If an operation does not exist
+		 */
+		std::vector<TF_Operation*> resolve_targets(const std::vector<std::string>& names) const;
+
+		/**
+		 * Runs the operations of model_options::targets, without fetching any output
+		 */
+		void run_targets();
+
+		/**
+		 * Runs operations for their side effects (initializers, assignments, table updates...), without
+		 * fetching any output
+		 * @param targets The operations to run, from resolve_targets()
+		 * @param feeds, values Optional graph tensors to feed, from resolve_outputs(), and their values
+		 */
+		void run_targets(const std::vector<TF_Operation*>& targets, const std::vector<TF_Output>& feeds = {}, const std::vector<tensor>& values = {});
+
+		/**
+		 * Runs the model and the given targets in the same session call
+		 * @return All the outputs of the model
+		 */
+		output_set run(const std::vector<tensor>& inputs, const std::vector<TF_Operation*>& targets);
+
+		/**
+		 * @class partial_run
+		 * @brief A single session run whose feeds and fetches are given in several stages
+		 *
+		 * Every tensor fed or fetched must be declared when the partial run is created, and can only be
+		 * fed or fetched once. Nodes already computed by a stage are not run again by the next ones, so an
+		 * expensive prefix of the graph is shared by the later stages. Created with model::begin_partial_run(),
+		 * it must not outlive its model.
+		 */
+		class partial_run
+		{
+		public:
+			partial_run(partial_run&& other) noexcept;
+			partial_run& operator=(partial_run&&) = delete;
+			partial_run(const partial_run&) = delete;
+			partial_run& operator=(const partial_run&) = delete;
+			~partial_run();
+
+			/**
+			 * Runs a stage
+			 * @param feeds, values Tensors fed in this stage and their values
+			 * @param fetches Tensors fetched in this stage
+			 * @param targets Operations run in this stage
+			 * @return The values of fetches, in the same order
+			 */
+			std::vector<tensor> run(const std::vector<TF_Output>& feeds, const std::vector<tensor>& values,
+									const std::vector<TF_Output>& fetches, const std::vector<TF_Operation*>& targets = {});
+
+		private:
+			friend class model;
+			partial_run(model* owner, const char* handle) : model_(owner), handle_(handle) {}
+
+			model* model_;
+			const char* handle_;
+		};
+
+		/**
+		 * Sets up a partial run
+		 * @param feeds All the tensors the stages will feed, from resolve_outputs()
+		 * @param fetches All the tensors the stages will fetch, from resolve_outputs()
+		 * @param targets All the operations the stages will run, from resolve_targets()
+		 */
+		partial_run begin_partial_run(const std::vector<TF_Output>& feeds, const std::vector<TF_Output>& fetches,
+									  const std::vector<TF_Operation*>& targets = {});
+
+		/**
+		 * Traces one run out of options.sample_every with FULL_TRACE, replacing the current profiler.
+		 * Profiling is off by default, and unsampled runs only pay for a counter increment
+		 * @return The profiler collecting the step statistics
+		 */
+		std::shared_ptr<profiler> enable_profiling(const profiler_options& options = profiler_options());
+
+		/**
+		 * Stops tracing runs. The profiler keeps the statistics collected so far
+		 */
+		void disable_profiling();
+
+		/**
+		 * @return The current profiler, null if profiling is off
+		 */
+		std::shared_ptr<profiler> get_profiler() const;
+
+		/**
+		 * Creates another session over the graph of this model, with the same inputs and outputs
+		 *
+		 * The graph is shared, but each session restores its own copy of the variables from the
+		 * SavedModel and runs the __saved_model_init_op signature: the C API has no way to share
+		 * variables between sessions. Init ops reading asset files are not supported.
+		 * @param options Configuration of the new session. Tags and signature are ignored
+		 */
+		model replicate(const model_options& options) const;
+
 	private:
-		TF_Graph* graph_;
-		TF_Session* session_;
+		using session_options_ptr = std::unique_ptr<TF_SessionOptions, decltype(&TF_DeleteSessionOptions)>;
+
+		static session_options_ptr new_session_options(const model_options& options);
+		static void delete_session(TF_Session* session);
+
+		void load(const std::string& filename, const model_options& options);
+		void load_graph_def(const std::string& filename, const model_options& options);
+		void parse_meta_graph(const TF_Buffer* meta_graph);
+		void restore();
+		TF_Output resolve_output(const std::string& name, bool check_index = true) const;
+		void run_bound(const std::vector<tensor>& inputs, TF_Tensor** outvals, size_t noutputs, const TF_Buffer* options = nullptr,
+					   TF_Operation* const* targets = nullptr, int ntargets = 0);
+		void run_session(const TF_Output* inputs, TF_Tensor* const* input_values, int ninputs,
+						 const TF_Output* outputs, TF_Tensor** output_values, int noutputs,
+						 const TF_Buffer* options = nullptr, TF_Operation* const* targets = nullptr, int ntargets = 0);
+		output_set run_with(const std::vector<tensor>& inputs, const run_options& options);
+
+		struct counters {
+			std::atomic<uint64_t> runs{ 0 };
+			std::atomic<uint64_t> deadline_exceeded{ 0 };
+			std::atomic<uint64_t> cancelled{ 0 };
+			std::atomic<int64_t> first_run_us{ 0 };
+			std::atomic<bool> ready{ false };
+
+			// Checked first, so runs do not touch the profiler when profiling is off. The sampling is
+			// counted here, so the shared profiler is only loaded by the runs that are traced
+			std::atomic<bool> profiling{ false };
+			std::atomic<uint64_t> profiled_runs{ 0 };
+			std::atomic<uint64_t> sample_every{ 0 };
+			std::shared_ptr<cppflow::profiler> profiler;
+		};
+
+		// The worker pool of run_async, whose tasks run on this very object. A copy gets its own pool,
+		// and assigning a model first waits for the runs pending on it. Moving a model also waits for
+		// the runs pending on the source, which use the members about to be moved, hence the first member
+		struct executor_slot {
+			executor_slot() = default;
+			executor_slot(const executor_slot&) {}
+			executor_slot(executor_slot&& other);
+			executor_slot& operator=(const executor_slot&);
+			executor_slot& operator=(executor_slot&& other);
+
+			void reset();
+
+			mutable std::shared_ptr<executor> current;
+		};
+		executor_slot executor_;
+
+		std::shared_ptr<TF_Graph> graph_;
+		std::shared_ptr<TF_Session> session_;
 		std::vector<TF_Output> inputs_;
 		std::vector<TF_Output> outputs_;
+		std::shared_ptr<const std::vector<std::string>> output_names_;
+		std::vector<signature> signatures_;
+		std::vector<TF_Operation*> targets_;
+
+		// How variables are restored (SaverDef), to create replicas
+		std::string export_dir_;
+		std::string saver_filename_tensor_;
+		std::string saver_restore_op_;
+
+		std::shared_ptr<counters> counters_ = std::make_shared<counters>();
+		load_stats load_stats_;
+
+		executor_options executor_options_;
+
+		executor& get_executor() const;
+
+		struct graph_index {
+			std::shared_ptr<const std::vector<node_info>> nodes;
+			std::shared_ptr<const std::unordered_map<std::string, size_t>> by_name;
+
+			/// TF_GraphNextOperation position after the last indexed operation
+			size_t end = 0;
+		};
+
+		// Shared with the copies and replicas, which have the same graph
+		std::shared_ptr<std::shared_ptr<const graph_index>> index_ = std::make_shared<std::shared_ptr<const graph_index>>();
+
+		std::shared_ptr<const graph_index> get_index() const;
 	};
 }
 
 namespace cppflow {
-	model::model(const std::string& filename, const std::vector<std::string>& inputs, const std::vector<std::string>& outputs) {
-		graph_ = TF_NewGraph();
+	std::string model_options::serialize_config() const {
+		auto set_toggle = [](proto::writer& w, int field, toggle value) {
+			// RewriterConfig::Toggle: DEFAULT = 0, ON = 1, OFF = 2
+			if (value != toggle::default_value)
+				w.varint(field, value == toggle::on ? 1 : 2);
+		};
 
-		// Create the session.
-		TF_SessionOptions* session_options = TF_NewSessionOptions();
-		TF_Buffer* run_options = TF_NewBufferFromString("", 0);
-		TF_Buffer* meta_graph = TF_NewBuffer();
+		proto::writer rewriter;
+		set_toggle(rewriter, 1, grappler.layout_optimizer);
+		set_toggle(rewriter, 3, grappler.constant_folding);
+		set_toggle(rewriter, 7, grappler.arithmetic_optimization);
+		set_toggle(rewriter, 8, grappler.dependency_optimization);
+		set_toggle(rewriter, 9, grappler.loop_optimization);
+		set_toggle(rewriter, 10, grappler.function_optimization);
+		set_toggle(rewriter, 11, grappler.debug_stripper);
+		set_toggle(rewriter, 13, grappler.shape_optimization);
+		set_toggle(rewriter, 14, grappler.remapping);
+		set_toggle(rewriter, 15, grappler.scoped_allocator_optimization);
+		set_toggle(rewriter, 18, grappler.pin_to_host_optimization);
+		set_toggle(rewriter, 22, grappler.implementation_selector);
+		set_toggle(rewriter, 23, grappler.auto_mixed_precision);
+		if (grappler.disable_model_pruning)
+			rewriter.boolean(2, true);
+		if (grappler.disable_meta_optimizer)
+			rewriter.boolean(19, true);
 
-		int tag_len = 1;
-		const char* tag = "serve";
-		session_ = TF_LoadSessionFromSavedModel(session_options, run_options, filename.c_str(), &tag, tag_len, graph_, meta_graph, context::get_status());
-		TF_DeleteSessionOptions(session_options);
-		TF_DeleteBuffer(run_options);
-		TF_DeleteBuffer(meta_graph);
+		// OptimizerOptions::global_jit_level = 5
+		proto::writer optimizer;
+		if (xla_jit != jit_level::default_value)
+			optimizer.varint(5, (int)xla_jit);
 
-		status_check(context::get_status());
+		// GraphOptions: optimizer_options = 3, rewrite_options = 10
+		proto::writer graph;
+		if (!optimizer.empty())
+			graph.message(3, optimizer);
+		if (!rewriter.empty())
+			graph.message(10, rewriter);
 
-		for (size_t i = 0; i < inputs.size(); ++i)
-		{
-			TF_Operation* oper = TF_GraphOperationByName(graph_, inputs[i].c_str());
-			if (oper == nullptr) throw std::runtime_error{ "invalid operator!" };
-			inputs_.emplace(inputs_.end(), TF_Output{ oper, 0 });
-		}
+		// ConfigProto: intra_op_parallelism_threads = 2, inter_op_parallelism_threads = 5,
+		// use_per_session_threads = 9, graph_options = 10, session_inter_op_thread_pool = 12
+		proto::writer config;
+		config.merge(this->config);
+		if (intra_op_threads > 0)
+			config.varint(2, intra_op_threads);
+		if (inter_op_threads > 0)
+			config.varint(5, inter_op_threads);
+		if (use_per_session_threads)
+			config.boolean(9, true);
+		if (!graph.empty())
+			config.message(10, graph);
+		for (auto num_threads : session_inter_op_thread_pools)
+			config.message(12, proto::writer().varint(1, num_threads));
 
-		for (size_t i = 0; i < outputs.size(); ++i)
-		{
-			TF_Operation* oper = TF_GraphOperationByName(graph_, outputs[i].c_str());
-			if (oper == nullptr) throw std::runtime_error{ "invalid operator!" };
-			outputs_.emplace(outputs_.end(), TF_Output{ oper, 0 });
-		}
+		return config.str();
 	}
 
-	tensor model::operator()(const tensor& input) {
-		assert(inputs_.size() == outputs_.size() == 1);
+	model::model(const std::string& filename, const model_options& options) {
+		load(filename, options);
+		targets_ = resolve_targets(options.targets);
 
-		//********* Allocate data for inputs & outputs
-		auto inp_tensor = TFE_TensorHandleResolve(input.tfe_handle.get(), context::get_status());
-		status_check(context::get_status());
+		const auto& sig = get_signature(options.signature);
+		inputs_ = sig.feeds;
+		outputs_ = sig.fetches;
 
-		TF_Tensor* inpvals[1] = { inp_tensor };
-		TF_Tensor* outvals[1] = { nullptr };
+		auto names = std::make_shared<std::vector<std::string>>();
+		for (auto& info : sig.outputs)
+			names->push_back(info.key);
+		output_names_ = names;
+	}
+
+	model::model(const std::string& filename, const std::vector<std::string>& inputs, const std::vector<std::string>& outputs, const model_options& options) {
+		load(filename, options);
+		targets_ = resolve_targets(options.targets);
+
+		for (auto& name : inputs)
+			inputs_.emplace_back(resolve_output(name));
+
+		for (auto& name : outputs)
+			outputs_.emplace_back(resolve_output(name));
+
+		output_names_ = std::make_shared<const std::vector<std::string>>(outputs);
+	}
 
-		TF_SessionRun(session_
-			, nullptr
-			, inputs_.data(), inpvals, (int)inputs_.size()
-			, outputs_.data(), outvals, (int)outputs_.size()
-			, nullptr, 0, nullptr, context::get_status());
+	model::session_options_ptr model::new_session_options(const model_options& options) {
+		session_options_ptr session_options(TF_NewSessionOptions(), TF_DeleteSessionOptions);
+		if (options.xla_jit == model_options::jit_level::on_1 || options.xla_jit == model_options::jit_level::on_2)
+			TF_EnableXLACompilation(session_options.get(), 1);
 
+		auto config = options.serialize_config();
+		TF_SetConfig(session_options.get(), config.data(), config.size(), context::get_status());
 		status_check(context::get_status());
 
-		return tensor(outvals[0]);
+		return session_options;
 	}
 
-	void model::operator()(const std::vector<tensor>& inputs, std::vector<tensor>& outputs)
+	void model::delete_session(TF_Session* session) {
+		// May run after the thread status is gone, so it uses its own
+		TF_Status* status = TF_NewStatus();
+		TF_CloseSession(session, status);
+		TF_DeleteSession(session, status);
+		TF_DeleteStatus(status);
+	}
+
+	model::model(std::shared_ptr<TF_Graph> graph, const std::vector<TF_Output>& inputs, const std::vector<TF_Output>& outputs,
+				 const model_options& options)
+		: graph_(std::move(graph))
+		, inputs_(inputs)
+		, outputs_(outputs)
 	{
-		//********* Allocate data for inputs & outputs
-		std::vector<TF_Tensor*> inpvals;
-		std::vector<TF_Tensor*> outvals;
+		auto start = std::chrono::steady_clock::now();
+		executor_options_ = options.executor;
 
-		try
-		{
-			inpvals.reserve(inputs_.size());
-			outvals.resize(outputs_.size());
+		auto session_options = new_session_options(options);
+		auto session = TF_NewSession(graph_.get(), session_options.get(), context::get_status());
+		status_check(context::get_status());
+		session_ = { session, delete_session };
+		load_stats_.session_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-			for (auto& v : inputs)
-				inpvals.emplace_back(TFE_TensorHandleResolve(v.tfe_handle.get(), context::get_status()));
+		auto names = std::make_shared<std::vector<std::string>>();
+		for (auto& output : outputs_)
+			names->push_back(std::string(TF_OperationName(output.oper)) + ":" + std::to_string(output.index));
+		output_names_ = names;
+		targets_ = resolve_targets(options.targets);
+	}
 
-			status_check(context::get_status());
+	void model::load(const std::string& filename, const model_options& options) {
+		if (options.format == model_options::file_format::graph_def)
+			return load_graph_def(filename, options);
 
-			TF_SessionRun(session_
-				, nullptr
-				, inputs_.data(), inpvals.data(), (int)inputs_.size()
-				, outputs_.data(), outvals.data(), (int)outputs_.size()
-				, nullptr, 0, nullptr, context::get_status());
+		using clock = std::chrono::steady_clock;
+		auto start = clock::now();
 
-			status_check(context::get_status());
+		graph_ = { TF_NewGraph(), TF_DeleteGraph };
+		export_dir_ = filename;
+		executor_options_ = options.executor;
+
+		// Create the session.
+		auto session_options = new_session_options(options);
+
+		TF_Buffer* run_options = TF_NewBufferFromString("", 0);
+		TF_Buffer* meta_graph = TF_NewBuffer();
+
+		std::vector<const char*> tags;
+		for (auto& tag : options.tags)
+			tags.push_back(tag.c_str());
+
+		auto session = TF_LoadSessionFromSavedModel(session_options.get(), run_options, filename.c_str(), tags.data(), (int)tags.size(), graph_.get(), meta_graph, context::get_status());
+		TF_DeleteBuffer(run_options);
 
-			for (auto& v : outvals)
-				outputs.emplace_back(v);
+		if (TF_GetCode(context::get_status()) != TF_OK)
+			TF_DeleteBuffer(meta_graph);
+		status_check(context::get_status());
+		session_ = { session, delete_session };
+
+		auto loaded = clock::now();
+		load_stats_.import_ms = std::chrono::duration<double, std::milli>(loaded - start).count();
+
+		try
+		{
+			parse_meta_graph(meta_graph);
 		}
-		catch (const std::exception& ex)
+		catch (...)
 		{
-			std::cerr << ex.what() << std::endl;
-			throw ex;
+			TF_DeleteBuffer(meta_graph);
+			throw;
 		}
+		TF_DeleteBuffer(meta_graph);
+		load_stats_.parse_ms = std::chrono::duration<double, std::milli>(clock::now() - loaded).count();
 	}
 
-	tensor model::operator()(const std::vector<tensor>& inputs)
-	{
-		//********* Allocate data for inputs & outputs
-		std::vector<TF_Tensor*> inpvals;
-		std::vector<TF_Tensor*> outvals;
-
-		try
-		{
-			assert(outputs_.size() == 1);
+	void model::load_graph_def(const std::string& filename, const model_options& options) {
+		using clock = std::chrono::steady_clock;
+		auto start = clock::now();
 
-			inpvals.reserve(inputs_.size());
-			outvals.resize(outputs_.size());
+		graph_ = { TF_NewGraph(), TF_DeleteGraph };
+		executor_options_ = options.executor;
 
-			for (auto& v : inputs)
-				inpvals.emplace_back(TFE_TensorHandleResolve(v.tfe_handle.get(), context::get_status()));
+		std::shared_ptr<const void> mapping;
+		std::string contents;
+		TF_Buffer graph_def{ nullptr, 0, nullptr };
+#if defined(__unix__) || defined(__APPLE__)
+		if (options.map_graph_def)
+		{
+			int fd = ::open(filename.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error{ "Could not open " + filename };
 
-			status_check(context::get_status());
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || st.st_size == 0)
+			{
+				::close(fd);
+				throw std::runtime_error{ "Could not read " + filename };
+			}
 
-			TF_SessionRun(session_
-				, nullptr
-				, inputs_.data(), inpvals.data(), (int)inputs_.size()
-				, outputs_.data(), outvals.data(), (int)outputs_.size()
-				, nullptr, 0, nullptr, context::get_status());
+			auto size = (size_t)st.st_size;
+			void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (data == MAP_FAILED)
+				throw std::runtime_error{ "Could not map " + filename };
 
-			status_check(context::get_status());
+			// Pages are read as the parser reaches them, there is no copy into a buffer
+			::madvise(data, size, MADV_SEQUENTIAL);
+			mapping = std::shared_ptr<const void>(data, [size](const void* p) { ::munmap(const_cast<void*>(p), size); });
+			graph_def = TF_Buffer{ data, size, nullptr };
 		}
-		catch (const std::exception& ex)
+#endif
+		if (graph_def.data == nullptr)
 		{
-			std::cerr << ex.what() << std::endl;
-			throw ex;
+			std::ifstream file(filename, std::ios::binary);
+			if (!file)
+				throw std::runtime_error{ "Could not open " + filename };
+			contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			graph_def = TF_Buffer{ contents.data(), contents.size(), nullptr };
 		}
 
-		return tensor(outvals[0]);
-	}
+		auto read = clock::now();
+		load_stats_.read_ms = std::chrono::duration<double, std::milli>(read - start).count();
 
-	model::operation::operation(TF_Graph* graph, TF_Operation* op) : op_(op), n_dims_(0)
-	{
-		name_ = TF_OperationName(op_);
-		if (std::strcmp("NoOp", name_.c_str()) == 0)
-			return;
+		std::unique_ptr<TF_ImportGraphDefOptions, decltype(&TF_DeleteImportGraphDefOptions)> import_options(TF_NewImportGraphDefOptions(), TF_DeleteImportGraphDefOptions);
+		TF_GraphImportGraphDef(graph_.get(), &graph_def, import_options.get(), context::get_status());
+		mapping.reset();
+		contents.clear();
+		status_check(context::get_status());
 
-		n_dims_ = TF_GraphGetTensorNumDims(graph, { op_, 0 }, context::get_status());
-		shape_.resize(n_dims_);
-		TF_GraphGetTensorShape(graph, { op_, 0 }, shape_.data(), n_dims_, context::get_status());
-	}
+		auto imported = clock::now();
+		load_stats_.import_ms = std::chrono::duration<double, std::milli>(imported - read).count();
 
-	const std::string& model::operation::name()
-	{
-		return name_;
-	}
+		auto session_options = new_session_options(options);
+		auto session = TF_NewSession(graph_.get(), session_options.get(), context::get_status());
+		status_check(context::get_status());
+		session_ = { session, delete_session };
 
-	const int32_t model::operation::dimention()
-	{
-		return n_dims_;
+		load_stats_.session_ms = std::chrono::duration<double, std::milli>(clock::now() - imported).count();
 	}
 
-	const std::vector<int64_t>& model::operation::shape()
+	void model::warmup(const std::vector<int64_t>& batch_sizes, int iterations)
 	{
-		return shape_;
-	}
+		auto& pool = buffer_pool::global();
 
-	model::operations::iterator::iterator(TF_Graph* graph, size_t pos)
-		: graph_(graph)
-		, pos_(pos)
-		, op_(nullptr)
-	{
-		if (pos != std::numeric_limits<size_t>::max())
-			op_ = TF_GraphNextOperation(graph, &pos_);
-	}
+		std::vector<std::vector<tensor>> requests;
+		for (auto batch_size : batch_sizes)
+		{
+			std::vector<tensor> inputs;
+			for (auto& input : inputs_)
+			{
+				auto dtype = TF_OperationOutputType(input);
+				if (dtype == TF_STRING)
+					throw std::runtime_error{ std::string("Can not synthesize the string input ") + TF_OperationName(input.oper) + ", warm up with recorded requests" };
 
-	model::operations::iterator model::operations::iterator::operator++()
-	{
-		op_ = TF_GraphNextOperation(graph_, &pos_);
-		if (!op_) pos_ = std::numeric_limits<size_t>::max();
-		return *this;
-	}
+				int n_dims = TF_GraphGetTensorNumDims(graph_.get(), input, context::get_status());
+				status_check(context::get_status());
+				if (n_dims < 0)
+					throw std::runtime_error{ std::string("Input ") + TF_OperationName(input.oper) + " has an unknown rank, warm up with recorded requests" };
 
-	model::operation model::operations::iterator::operator*()
-	{
-		return operation(graph_, op_);
-	}
+				std::vector<int64_t> shape(n_dims);
+				TF_GraphGetTensorShape(graph_.get(), input, shape.data(), n_dims, context::get_status());
+				status_check(context::get_status());
 
-	bool model::operations::iterator::operator!=(const iterator& iter)
-	{
-		return bool(op_ != iter.op_);
+				for (int i = 0; i < n_dims; ++i)
+					if (shape[i] < 0)
+						shape[i] = i == 0 ? batch_size : 1;
+
+				// Validates the shape, so the tensor accepts the buffer and the deallocator always returns it
+				auto len = tensor::byte_size(dtype, shape);
+				auto data = pool.allocate(len);
+				std::memset(data, 0, len);
+				inputs.emplace_back(dtype, data, len, shape, buffer_pool::tensor_deallocator, &pool);
+			}
+			requests.push_back(std::move(inputs));
+		}
+
+		warmup(requests, iterations);
 	}
 
-	bool model::operations::iterator::operator==(const iterator& iter)
+	void model::warmup(const std::vector<std::vector<tensor>>& requests, int iterations)
 	{
-		return bool(op_ == iter.op_);
-	}
+		auto outputs = make_output_set();
+		for (auto& inputs : requests)
+			for (int i = 0; i < iterations; ++i)
+				run(inputs, outputs);
 
-	model::operations::operations(model* _model) : graph_(_model->graph_)
-	{}
+		counters_->ready.store(true);
+	}
 
-	model::operations::iterator model::operations::begin()
+	bool model::ready() const
 	{
-		return operations::iterator(graph_, (size_t)0);
+		return counters_->ready.load();
 	}
 
-	model::operations::iterator model::operations::end()
+	model::load_stats model::get_load_stats() const
 	{
-		return operations::iterator(graph_, std::numeric_limits<size_t>::max());
+		auto stats = load_stats_;
+		stats.first_run_ms = counters_->first_run_us.load(std::memory_order_relaxed) / 1000.0;
+		return stats;
 	}
 
-	model::operations::iterator model::operations::find(const char* op)
+	void model::parse_meta_graph(const TF_Buffer* meta_graph)
 	{
-		auto it = begin();
-		for (auto et = end(); it != et; ++it)
-		{
-			if ((*it).name() == op)
-				break;
-		}
+		auto parse_tensor_info = [this](proto::reader entry) {
+			// map<string, TensorInfo> entry: key = 1, value = 2
+			tensor_info info{};
+			info.dtype = static_cast<datatype>(0);
+			while (entry.next())
+			{
+				if (entry.field() == 1)
+					info.key = entry.bytes();
+				else if (entry.field() == 2)
+				{
+					// TensorInfo: name = 1, dtype = 2, tensor_shape = 3
+					auto ti = entry.message();
+					while (ti.next())
+					{
+						if (ti.field() == 1)
+							info.name = ti.bytes();
+						else if (ti.field() == 2)
+							info.dtype = static_cast<datatype>(ti.varint());
+						else if (ti.field() == 3)
+						{
+							// TensorShapeProto: dim = 2 (Dim: size = 1), unknown_rank = 3
+							auto shape = ti.message();
+							while (shape.next())
+							{
+								if (shape.field() == 3)
+									info.unknown_rank = shape.varint() != 0;
+								else if (shape.field() == 2)
+								{
+									int64_t size = -1;
+									auto dim = shape.message();
+									while (dim.next())
+										if (dim.field() == 1)
+											size = dim.varint();
+									info.shape.push_back(size);
+								}
+							}
+						}
+					}
+				}
+			}
+			// Some signatures (e.g. __saved_model_init_op) name operations without outputs, to be run as targets.
+			// Sparse and composite tensors have no name. Both are only reported when the signature is used
+			info.output = TF_Output{ nullptr, 0 };
+			if (!info.name.empty() && TF_GraphOperationByName(graph_.get(), info.name.substr(0, info.name.rfind(':')).c_str()) != nullptr)
+				info.output = resolve_output(info.name, false);
+			return info;
+		};
+
+		auto by_key = [](const tensor_info& a, const tensor_info& b) { return a.key < b.key; };
+
+		// MetaGraphDef: saver_def = 3, signature_def = 5 (a map<string, SignatureDef>)
+		proto::reader meta(meta_graph->data, meta_graph->length);
+		while (meta.next())
+		{
+			if (meta.field() == 3)
+			{
+				// SaverDef: filename_tensor_name = 1, restore_op_name = 3
+				auto saver = meta.message();
+				while (saver.next())
+				{
+					if (saver.field() == 1)
+						saver_filename_tensor_ = saver.bytes();
+					else if (saver.field() == 3)
+						saver_restore_op_ = saver.bytes();
+				}
+				continue;
+			}
+
+			if (meta.field() != 5)
+				continue;
+
+			signature sig;
+			auto entry = meta.message();
+			while (entry.next())
+			{
+				if (entry.field() == 1)
+					sig.name = entry.bytes();
+				else if (entry.field() == 2)
+				{
+					// SignatureDef: inputs = 1, outputs = 2, method_name = 3
+					auto def = entry.message();
+					while (def.next())
+					{
+						if (def.field() == 1)
+							sig.inputs.push_back(parse_tensor_info(def.message()));
+						else if (def.field() == 2)
+							sig.outputs.push_back(parse_tensor_info(def.message()));
+						else if (def.field() == 3)
+							sig.method_name = def.bytes();
+					}
+				}
+			}
+
+			std::sort(sig.inputs.begin(), sig.inputs.end(), by_key);
+			std::sort(sig.outputs.begin(), sig.outputs.end(), by_key);
+			for (auto& info : sig.inputs)
+				sig.feeds.push_back(info.output);
+			for (auto& info : sig.outputs)
+				sig.fetches.push_back(info.output);
+
+			for (auto* infos : { &sig.inputs, &sig.outputs })
+				for (auto& info : *infos)
+					if (info.output.oper == nullptr && sig.unresolved.empty())
+						sig.unresolved = info.name.empty()
+							? "Signature " + sig.name + " has the sparse or composite tensor " + info.key + ", which is not supported"
+							: "Signature " + sig.name + " refers to " + info.name + ", which is not in the graph";
+
+			signatures_.push_back(std::move(sig));
+		}
+
+		std::sort(signatures_.begin(), signatures_.end(), [](const signature& a, const signature& b) { return a.name < b.name; });
+	}
+
+	TF_Output model::resolve_output(const std::string& name, bool check_index) const
+	{
+		// "operation:index", the index defaults to 0
+		auto oper_name = name;
+		int index = 0;
+		auto colon = name.rfind(':');
+		if (colon != std::string::npos && colon + 1 < name.size()
+			&& name.find_first_not_of("0123456789", colon + 1) == std::string::npos)
+		{
+			oper_name = name.substr(0, colon);
+			index = std::stoi(name.substr(colon + 1));
+		}
+
+		TF_Operation* oper = TF_GraphOperationByName(graph_.get(), oper_name.c_str());
+		if (oper == nullptr)
+			throw std::runtime_error{ "No operation named " + oper_name + " in the graph" };
+		if (check_index && index >= TF_OperationNumOutputs(oper))
+			throw std::runtime_error{ "Operation " + oper_name + " has no output " + std::to_string(index) };
+
+		return TF_Output{ oper, index };
+	}
+
+	const std::vector<model::signature>& model::signatures() const
+	{
+		return signatures_;
+	}
+
+	const model::signature& model::get_signature(const std::string& name) const
+	{
+		for (auto& sig : signatures_)
+		{
+			if (sig.name != name)
+				continue;
+			if (!sig.unresolved.empty())
+				throw std::runtime_error{ sig.unresolved };
+			return sig;
+		}
+
+		std::string available;
+		for (auto& sig : signatures_)
+			available += (available.empty() ? "" : ", ") + sig.name;
+		throw std::runtime_error{ "No signature named " + name + " (available: " + available + ")" };
+	}
+
+	std::vector<tensor> model::run(const signature& sig, const std::vector<tensor>& inputs)
+	{
+		if (!sig.unresolved.empty())
+			throw std::runtime_error{ sig.unresolved };
+		if (inputs.size() != sig.inputs.size())
+			throw std::runtime_error{ "Signature " + sig.name + " expects " + std::to_string(sig.inputs.size()) + " inputs" };
+
+		std::vector<std::shared_ptr<TF_Tensor>> inptensors;
+		std::vector<TF_Tensor*> inpvals;
+		std::vector<TF_Tensor*> outvals(sig.fetches.size(), nullptr);
+
+		inptensors.reserve(inputs.size());
+		inpvals.reserve(inputs.size());
+		for (auto& v : inputs) {
+			inptensors.emplace_back(v.get_tensor());
+			inpvals.emplace_back(inptensors.back().get());
+		}
+
+		run_session(sig.feeds.data(), inpvals.data(), (int)inpvals.size(), sig.fetches.data(), outvals.data(), (int)outvals.size());
+
+		std::vector<tensor> outputs;
+		outputs.reserve(outvals.size());
+		for (auto& v : outvals)
+			outputs.emplace_back(v);
+		return outputs;
+	}
+
+	void model::run_session(const TF_Output* inputs, TF_Tensor* const* input_values, int ninputs,
+							const TF_Output* outputs, TF_Tensor** output_values, int noutputs,
+							const TF_Buffer* options, TF_Operation* const* targets, int ntargets)
+	{
+		// Only the first run is timed
+		bool first_run = counters_->runs.fetch_add(1, std::memory_order_relaxed) == 0;
+		auto start = first_run ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+		std::shared_ptr<cppflow::profiler> sampler;
+		if (counters_->profiling.load(std::memory_order_relaxed))
+		{
+			auto every = counters_->sample_every.load(std::memory_order_relaxed);
+			if (every != 0 && counters_->profiled_runs.fetch_add(1, std::memory_order_relaxed) % every == 0)
+				sampler = std::atomic_load(&counters_->profiler);
+		}
+
+		if (!sampler)
+		{
+			TF_SessionRun(session_.get()
+				, options
+				, inputs, input_values, ninputs
+				, outputs, output_values, noutputs
+				, targets, ntargets, nullptr, context::get_status());
+		}
+		else
+		{
+			// RunOptions: trace_level = 1 (FULL_TRACE = 3), merged over the given options
+			proto::writer traced;
+			if (options != nullptr)
+				traced.merge(std::string(static_cast<const char*>(options->data), options->length));
+			traced.varint(1, 3);
+			TF_Buffer traced_options{ traced.str().data(), traced.str().size(), nullptr };
+
+			std::unique_ptr<TF_Buffer, decltype(&TF_DeleteBuffer)> metadata(TF_NewBuffer(), TF_DeleteBuffer);
+			TF_SessionRun(session_.get()
+				, &traced_options
+				, inputs, input_values, ninputs
+				, outputs, output_values, noutputs
+				, targets, ntargets, metadata.get(), context::get_status());
+
+			if (TF_GetCode(context::get_status()) == TF_OK)
+				sampler->record(metadata.get(), graph_.get());
+		}
+
+		if (first_run)
+			counters_->first_run_us.store(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+
+		if (TF_GetCode(context::get_status()) == TF_DEADLINE_EXCEEDED)
+			counters_->deadline_exceeded.fetch_add(1, std::memory_order_relaxed);
+		status_check(context::get_status());
+	}
+
+	std::shared_ptr<profiler> model::enable_profiling(const profiler_options& options)
+	{
+		auto created = std::make_shared<profiler>(options);
+		std::atomic_store(&counters_->profiler, created);
+		counters_->sample_every.store(options.sample_every, std::memory_order_relaxed);
+		counters_->profiled_runs.store(0, std::memory_order_relaxed);
+		counters_->profiling.store(true, std::memory_order_relaxed);
+		return created;
+	}
+
+	void model::disable_profiling()
+	{
+		counters_->profiling.store(false, std::memory_order_relaxed);
+		std::atomic_store(&counters_->profiler, std::shared_ptr<profiler>());
+	}
+
+	std::shared_ptr<profiler> model::get_profiler() const
+	{
+		return std::atomic_load(&counters_->profiler);
+	}
+
+	model model::replicate(const model_options& options) const
+	{
+		using clock = std::chrono::steady_clock;
+		auto start = clock::now();
+
+		model replica(*this);
+		replica.executor_options_ = options.executor;
+		replica.counters_ = std::make_shared<counters>();
+		replica.load_stats_ = load_stats();
+
+		auto session_options = new_session_options(options);
+		auto session = TF_NewSession(graph_.get(), session_options.get(), context::get_status());
+		status_check(context::get_status());
+		replica.session_ = { session, delete_session };
+
+		auto created = clock::now();
+		replica.load_stats_.session_ms = std::chrono::duration<double, std::milli>(created - start).count();
+
+		replica.restore();
+		replica.load_stats_.restore_ms = std::chrono::duration<double, std::milli>(clock::now() - created).count();
+		return replica;
+	}
+
+	void model::restore()
+	{
+		if (!saver_restore_op_.empty())
+		{
+			// Same checkpoint prefix as the SavedModel loader
+			auto filename = tensor(export_dir_ + "/variables/variables").get_tensor();
+			TF_Output feed = resolve_output(saver_filename_tensor_);
+			TF_Tensor* feed_value = filename.get();
+			TF_Operation* target = TF_GraphOperationByName(graph_.get(), saver_restore_op_.c_str());
+			if (target == nullptr)
+				throw std::runtime_error{ "No operation named " + saver_restore_op_ + " in the graph" };
+
+			TF_SessionRun(session_.get(), nullptr, &feed, &feed_value, 1, nullptr, nullptr, 0, &target, 1, nullptr, context::get_status());
+			status_check(context::get_status());
+		}
+
+		for (auto& sig : signatures_)
+		{
+			if (sig.name != "__saved_model_init_op")
+				continue;
+
+			for (auto& info : sig.outputs)
+			{
+				TF_Operation* target = info.output.oper;
+				if (target == nullptr)
+					throw std::runtime_error{ sig.unresolved };
+				TF_SessionRun(session_.get(), nullptr, nullptr, nullptr, 0, nullptr, nullptr, 0, &target, 1, nullptr, context::get_status());
+				status_check(context::get_status());
+			}
+		}
+	}
+
+	std::future<model::output_set> model::run_async(std::vector<tensor> inputs)
+	{
+		return get_executor().submit([this, inputs = std::move(inputs)]() {
+			return run(inputs);
+		});
+	}
+
+	void model::run_async(std::vector<tensor> inputs, std::function<void(output_set outputs, std::exception_ptr error)> done)
+	{
+		get_executor().post([this, inputs = std::move(inputs), done = std::move(done)]() {
+			output_set outputs;
+			std::exception_ptr error;
+			try
+			{
+				outputs = run(inputs);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+			done(std::move(outputs), error);
+		});
+	}
+
+	model::output_set model::run(const std::vector<tensor>& inputs, const run_options& options)
+	{
+		auto& token = options.cancellation;
+		if (token && token->cancelled())
+		{
+			counters_->cancelled.fetch_add(1, std::memory_order_relaxed);
+			throw std::runtime_error{ "The run has been cancelled" };
+		}
+
+		auto outputs = run_with(inputs, options);
+
+		// Cancelled while in flight: the result is discarded
+		if (token && token->cancelled())
+		{
+			counters_->cancelled.fetch_add(1, std::memory_order_relaxed);
+			throw std::runtime_error{ "The run has been cancelled" };
+		}
+		return outputs;
+	}
+
+	std::future<model::output_set> model::run_async(std::vector<tensor> inputs, run_options options)
+	{
+		if (!options.cancellation)
+			return get_executor().submit([this, inputs = std::move(inputs), options = std::move(options)]() {
+				return run_with(inputs, options);
+			});
+
+		// The promise is settled once, by the run or by the cancellation, whichever comes first
+		struct pending {
+			std::promise<output_set> result;
+			std::atomic<bool> settled{ false };
+		};
+		auto state = std::make_shared<pending>();
+		auto future = state->result.get_future();
+		auto counters = counters_;
+		auto token = options.cancellation;
+
+		auto id = token->subscribe([state, counters]() {
+			if (!state->settled.exchange(true))
+			{
+				counters->cancelled.fetch_add(1, std::memory_order_relaxed);
+				state->result.set_exception(std::make_exception_ptr(std::runtime_error{ "The run has been cancelled" }));
+			}
+		});
+
+		try
+		{
+			get_executor().post([this, state, id, inputs = std::move(inputs), options = std::move(options)]() {
+				if (!state->settled.load())
+				{
+					try
+					{
+						auto outputs = run_with(inputs, options);
+						if (!state->settled.exchange(true))
+							state->result.set_value(std::move(outputs));
+					}
+					catch (...)
+					{
+						if (!state->settled.exchange(true))
+							state->result.set_exception(std::current_exception());
+					}
+				}
+				options.cancellation->unsubscribe(id);
+			});
+		}
+		catch (...)
+		{
+			token->unsubscribe(id);
+			throw;
+		}
+		return future;
+	}
+
+	model::output_set model::run_with(const std::vector<tensor>& inputs, const run_options& options)
+	{
+		auto serialized = options.serialize();
+		TF_Buffer buffer{ serialized.data(), serialized.size(), nullptr };
+
+		auto outputs = make_output_set();
+		run_bound(inputs, outputs.outvals_.data(), outputs.outvals_.size(), serialized.empty() ? nullptr : &buffer);
+
+		for (size_t i = 0; i < outputs.outvals_.size(); ++i)
+		{
+			outputs.values_[i] = tensor(outputs.outvals_[i]);
+			outputs.outvals_[i] = nullptr;
+		}
+		return outputs;
+	}
+
+	model::run_stats model::stats() const
+	{
+		run_stats stats;
+		stats.runs = counters_->runs.load(std::memory_order_relaxed);
+		stats.deadline_exceeded = counters_->deadline_exceeded.load(std::memory_order_relaxed);
+		stats.cancelled = counters_->cancelled.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	void cancellation_token::cancel()
+	{
+		std::vector<std::pair<size_t, std::function<void()>>> callbacks;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (cancelled_.exchange(true))
+				return;
+			callbacks.swap(callbacks_);
+		}
+
+		for (auto& callback : callbacks)
+			callback.second();
+	}
+
+	bool cancellation_token::cancelled() const
+	{
+		return cancelled_.load();
+	}
+
+	size_t cancellation_token::subscribe(std::function<void()> f)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!cancelled_.load())
+			{
+				callbacks_.emplace_back(next_id_, std::move(f));
+				return next_id_++;
+			}
+		}
+
+		f();
+		return std::numeric_limits<size_t>::max();
+	}
+
+	void cancellation_token::unsubscribe(size_t id)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		callbacks_.erase(std::remove_if(callbacks_.begin(), callbacks_.end(),
+			[id](const std::pair<size_t, std::function<void()>>& callback) { return callback.first == id; }), callbacks_.end());
+	}
+
+	std::string run_options::serialize() const
+	{
+		// RunOptions: timeout_in_ms = 2
+		proto::writer options;
+		if (timeout_ms > 0)
+			options.varint(2, timeout_ms);
+		return options.str();
+	}
+
+	executor& model::get_executor() const
+	{
+		auto current = std::atomic_load(&executor_.current);
+		if (current)
+			return *current;
+
+		// Several threads may race to create it, only the first one is kept
+		auto created = std::make_shared<executor>(executor_options_);
+		if (std::atomic_compare_exchange_strong(&executor_.current, &current, created))
+			return *created;
+		return *current;
+	}
+
+	model::~model()
+	{
+		// Before any member is destroyed, as the pending runs use them
+		executor_.reset();
+	}
+
+	model::executor_slot::executor_slot(executor_slot&& other)
+	{
+		other.reset();
+	}
+
+	model::executor_slot& model::executor_slot::operator=(const executor_slot&)
+	{
+		reset();
+		return *this;
+	}
+
+	model::executor_slot& model::executor_slot::operator=(executor_slot&& other)
+	{
+		if (this != &other) {
+			reset();
+			other.reset();
+		}
+		return *this;
+	}
+
+	void model::executor_slot::reset()
+	{
+		// Destroying the executor runs the queued tasks and joins its workers, out of the atomic access
+		auto previous = std::atomic_exchange(&current, std::shared_ptr<executor>());
+		previous.reset();
+	}
+
+	tensor model::operator()(const tensor& input) {
+		assert(inputs_.size() == 1);
+
+		//********* Allocate data for inputs & outputs
+		TF_Tensor* inpvals[1] = { input.get_tensor().get() };
+		TF_Tensor* outvals[1] = { nullptr };
+
+		// Only the first output is fetched
+		run_session(inputs_.data(), inpvals, 1, outputs_.data(), outvals, 1);
+
+		return tensor(outvals[0]);
+	}
+
+	void model::operator()(const std::vector<tensor>& inputs, std::vector<tensor>& outputs)
+	{
+		std::vector<TF_Tensor*> outvals(outputs_.size(), nullptr);
+		run_bound(inputs, outvals.data(), outvals.size());
+
+		outputs.reserve(outputs.size() + outvals.size());
+		for (auto* value : outvals)
+			outputs.push_back(tensor(value));
+	}
+
+	tensor model::operator()(const std::vector<tensor>& inputs)
+	{
+		// Only the first output is fetched
+		TF_Tensor* outvals[1] = { nullptr };
+		run_bound(inputs, outvals, 1);
+
+		return tensor(outvals[0]);
+	}
+
+	model::output_set model::make_output_set() const
+	{
+		output_set outputs;
+		outputs.names_ = output_names_;
+		outputs.values_.resize(outputs_.size());
+		outputs.outvals_.resize(outputs_.size(), nullptr);
+		return outputs;
+	}
+
+	model::output_set model::run(const std::vector<tensor>& inputs)
+	{
+		auto outputs = make_output_set();
+		run(inputs, outputs);
+		return outputs;
+	}
+
+	void model::run(const std::vector<tensor>& inputs, output_set& outputs)
+	{
+		if (outputs.names_ != output_names_)
+			outputs = make_output_set();
+
+		run_bound(inputs, outputs.outvals_.data(), outputs.outvals_.size());
+
+		for (size_t i = 0; i < outputs.outvals_.size(); ++i)
+		{
+			outputs.values_[i] = tensor(outputs.outvals_[i]);
+			outputs.outvals_[i] = nullptr;
+		}
+	}
+
+	void model::run_bound(const std::vector<tensor>& inputs, TF_Tensor** outvals, size_t noutputs, const TF_Buffer* options,
+						  TF_Operation* const* targets, int ntargets)
+	{
+		if (inputs.size() != inputs_.size())
+			throw std::runtime_error{ "The model expects " + std::to_string(inputs_.size()) + " inputs, got " + std::to_string(inputs.size()) };
+
+		// The resolved tensors are kept alive by the input tensors during the call
+		std::vector<TF_Tensor*> inpvals(inputs.size());
+		for (size_t i = 0; i < inputs.size(); ++i)
+			inpvals[i] = inputs[i].get_tensor().get();
+
+		run_session(inputs_.data(), inpvals.data(), (int)inpvals.size(), outputs_.data(), outvals, (int)noutputs, options, targets, ntargets);
+	}
+
+	model::partial_run model::begin_partial_run(const std::vector<TF_Output>& feeds, const std::vector<TF_Output>& fetches,
+												const std::vector<TF_Operation*>& targets)
+	{
+		const char* handle = nullptr;
+		TF_SessionPRunSetup(session_.get(), feeds.data(), (int)feeds.size(), fetches.data(), (int)fetches.size(),
+			targets.data(), (int)targets.size(), &handle, context::get_status());
+		status_check(context::get_status());
+
+		return partial_run(this, handle);
+	}
+
+	model::partial_run::partial_run(partial_run&& other) noexcept
+		: model_(other.model_)
+		, handle_(other.handle_)
+	{
+		other.handle_ = nullptr;
+	}
+
+	model::partial_run::~partial_run()
+	{
+		if (handle_ != nullptr)
+			TF_DeletePRunHandle(handle_);
+	}
+
+	std::vector<tensor> model::partial_run::run(const std::vector<TF_Output>& feeds, const std::vector<tensor>& values,
+												const std::vector<TF_Output>& fetches, const std::vector<TF_Operation*>& targets)
+	{
+		if (feeds.size() != values.size())
+			throw std::runtime_error{ "Expected " + std::to_string(feeds.size()) + " values to feed, got " + std::to_string(values.size()) };
+
+		std::vector<TF_Tensor*> inpvals(values.size());
+		for (size_t i = 0; i < values.size(); ++i)
+			inpvals[i] = values[i].get_tensor().get();
+		std::vector<TF_Tensor*> outvals(fetches.size(), nullptr);
+
+		TF_SessionPRun(model_->session_.get(), handle_, feeds.data(), inpvals.data(), (int)inpvals.size(),
+			fetches.data(), outvals.data(), (int)outvals.size(), targets.data(), (int)targets.size(), context::get_status());
+		status_check(context::get_status());
+
+		std::vector<tensor> outputs;
+		outputs.reserve(outvals.size());
+		for (auto& v : outvals)
+			outputs.emplace_back(v);
+		return outputs;
+	}
+
+	std::vector<TF_Output> model::resolve_outputs(const std::vector<std::string>& names) const
+	{
+		std::vector<TF_Output> outputs;
+		outputs.reserve(names.size());
+		for (auto& name : names)
+			outputs.push_back(resolve_output(name));
+		return outputs;
+	}
+
+	std::vector<TF_Operation*> model::resolve_targets(const std::vector<std::string>& names) const
+	{
+		std::vector<TF_Operation*> targets;
+		targets.reserve(names.size());
+		for (auto& name : names)
+		{
+			TF_Operation* oper = TF_GraphOperationByName(graph_.get(), name.c_str());
+			if (oper == nullptr)
+				throw std::runtime_error{ "No operation named " + name + " in the graph" };
+			targets.push_back(oper);
+		}
+		return targets;
+	}
+
+	void model::run_targets()
+	{
+		run_targets(targets_);
+	}
+
+	void model::run_targets(const std::vector<TF_Operation*>& targets, const std::vector<TF_Output>& feeds, const std::vector<tensor>& values)
+	{
+		if (feeds.size() != values.size())
+			throw std::runtime_error{ "Expected " + std::to_string(feeds.size()) + " values to feed, got " + std::to_string(values.size()) };
+
+		std::vector<TF_Tensor*> inpvals(values.size());
+		for (size_t i = 0; i < values.size(); ++i)
+			inpvals[i] = values[i].get_tensor().get();
+
+		run_session(feeds.data(), inpvals.data(), (int)inpvals.size(), nullptr, nullptr, 0, nullptr, targets.data(), (int)targets.size());
+	}
+
+	model::output_set model::run(const std::vector<tensor>& inputs, const std::vector<TF_Operation*>& targets)
+	{
+		auto outputs = make_output_set();
+		run_bound(inputs, outputs.outvals_.data(), outputs.outvals_.size(), nullptr, targets.data(), (int)targets.size());
+
+		for (size_t i = 0; i < outputs.outvals_.size(); ++i)
+		{
+			outputs.values_[i] = tensor(outputs.outvals_[i]);
+			outputs.outvals_[i] = nullptr;
+		}
+		return outputs;
+	}
+
+	model::prepared_call model::prepare(const std::vector<std::vector<int64_t>>& input_shapes)
+	{
+		return prepared_call(this, inputs_, outputs_, input_shapes);
+	}
+
+	model::prepared_call model::prepare_signature(const signature& sig, const std::vector<std::vector<int64_t>>& input_shapes)
+	{
+		if (!sig.unresolved.empty())
+			throw std::runtime_error{ sig.unresolved };
+		return prepared_call(this, sig.feeds, sig.fetches, input_shapes);
+	}
+
+	model::prepared_call::prepared_call(model* owner, std::vector<TF_Output> feeds, std::vector<TF_Output> fetches,
+										const std::vector<std::vector<int64_t>>& input_shapes)
+		: model_(owner)
+		, feeds_(std::move(feeds))
+		, fetches_(std::move(fetches))
+		, buffers_(feeds_.size())
+		, bound_(feeds_.size())
+		, input_values_(feeds_.size(), nullptr)
+		, output_values_(fetches_.size(), nullptr)
+	{
+		if (input_shapes.size() > feeds_.size())
+			throw std::runtime_error{ "More input shapes than inputs" };
+
+		for (size_t i = 0; i < input_shapes.size(); ++i)
+		{
+			auto dtype = TF_OperationOutputType(feeds_[i]);
+			if (dtype == TF_STRING)
+				continue; // Variable size elements, must be bound with set_input
+
+			// Buffers are preallocated, so every dimension must be known
+			for (auto d : input_shapes[i])
+				if (d < 0)
+					throw std::runtime_error{ "The shape of input " + std::to_string(i) + " has an unknown or negative dimension" };
+
+			// TF gives the buffer back to the pool through the deallocator, even if TF_NewTensor fails
+			auto& pool = buffer_pool::global();
+			auto len = tensor::byte_size(dtype, input_shapes[i]);
+			auto data = pool.allocate(len);
+			auto t = TF_NewTensor(dtype, input_shapes[i].data(), (int)input_shapes[i].size(), data, len, buffer_pool::tensor_deallocator, &pool);
+			if (t == nullptr)
+				throw std::runtime_error{ "Could not allocate input " + std::to_string(i) };
+
+			buffers_[i] = { t, TF_DeleteTensor };
+			input_values_[i] = t;
+		}
+	}
+
+	model::prepared_call::~prepared_call()
+	{
+		release_outputs();
+	}
+
+	template<typename T>
+	T* model::prepared_call::input(size_t i)
+	{
+		if (input_dtype(i) != deduce_tf_type<T>())
+			throw std::runtime_error{ "Input " + std::to_string(i) + " is " + to_string(input_dtype(i)) };
+
+		return static_cast<T*>(input_data(i));
+	}
+
+	void* model::prepared_call::input_data(size_t i)
+	{
+		if (!buffers_[i])
+			throw std::runtime_error{ "Input " + std::to_string(i) + " has no preallocated buffer" };
+
+		bound_[i].reset();
+		input_values_[i] = buffers_[i].get();
+		return TF_TensorData(buffers_[i].get());
+	}
+
+	datatype model::prepared_call::input_dtype(size_t i) const
+	{
+		return TF_OperationOutputType(feeds_[i]);
+	}
+
+	void model::prepared_call::set_input(size_t i, const tensor& value)
+	{
+		bound_[i] = value.get_tensor();
+		input_values_[i] = bound_[i].get();
+	}
+
+	void model::prepared_call::run()
+	{
+		for (size_t i = 0; i < input_values_.size(); ++i)
+			if (input_values_[i] == nullptr)
+				throw std::runtime_error{ "Input " + std::to_string(i) + " has not been set" };
+
+		release_outputs();
+		model_->run_session(feeds_.data(), input_values_.data(), (int)input_values_.size(),
+			fetches_.data(), output_values_.data(), (int)output_values_.size());
+	}
+
+	template<typename T>
+	tensor_view<const T> model::prepared_call::output(size_t i) const
+	{
+		if (output_values_[i] == nullptr)
+			throw std::runtime_error{ "Output " + std::to_string(i) + " is not available" };
+
+		return tensor_view<const T>(nullptr, output_values_[i]);
+	}
+
+	tensor model::prepared_call::take_output(size_t i)
+	{
+		if (output_values_[i] == nullptr)
+			throw std::runtime_error{ "Output " + std::to_string(i) + " is not available" };
+
+		auto t = output_values_[i];
+		output_values_[i] = nullptr;
+		return tensor(t);
+	}
 
-		return it;
+	void model::prepared_call::release_outputs()
+	{
+		for (auto& t : output_values_)
+		{
+			if (t != nullptr)
+				TF_DeleteTensor(t);
+			t = nullptr;
+		}
+	}
+
+	size_t model::output_set::size() const
+	{
+		return values_.size();
+	}
+
+	const tensor& model::output_set::operator[](size_t i) const
+	{
+		return values_[i];
+	}
+
+	const tensor& model::output_set::operator[](const std::string& name) const
+	{
+		for (size_t i = 0; i < names_->size(); ++i)
+			if ((*names_)[i] == name)
+				return values_[i];
+
+		throw std::runtime_error{ "No output named " + name };
+	}
+
+	const std::vector<std::string>& model::output_set::names() const
+	{
+		return *names_;
+	}
+
+	model::operation::operation(TF_Graph* graph, TF_Operation* op) : node_(std::make_shared<node_info>(read(graph, op)))
+	{}
+
+	model::operation::operation(std::shared_ptr<const node_info> node) : node_(std::move(node))
+	{}
+
+	model::node_info model::operation::read(TF_Graph* graph, TF_Operation* op)
+	{
+		node_info node;
+		node.op = op;
+		node.name = TF_OperationName(op);
+		node.type = TF_OperationOpType(op);
+
+		int n = TF_OperationNumOutputs(op);
+		node.outputs.resize(n);
+		for (int i = 0; i < n; ++i)
+		{
+			auto& out = node.outputs[i];
+			out.dtype = TF_OperationOutputType({ op, i });
+			out.n_dims = TF_GraphGetTensorNumDims(graph, { op, i }, context::get_status());
+			if (TF_GetCode(context::get_status()) != TF_OK || out.n_dims < 0)
+			{
+				out.n_dims = -1;
+				continue;
+			}
+
+			out.shape.resize(out.n_dims);
+			TF_GraphGetTensorShape(graph, { op, i }, out.shape.data(), out.n_dims, context::get_status());
+		}
+		return node;
+	}
+
+	const std::string& model::operation::name() const
+	{
+		return node_->name;
+	}
+
+	const std::string& model::operation::type() const
+	{
+		return node_->type;
+	}
+
+	const int32_t model::operation::dimention() const
+	{
+		return node_->outputs.empty() ? 0 : node_->outputs[0].n_dims;
+	}
+
+	const std::vector<int64_t>& model::operation::shape() const
+	{
+		static const std::vector<int64_t> none;
+		return node_->outputs.empty() ? none : node_->outputs[0].shape;
+	}
+
+	int model::operation::num_outputs() const
+	{
+		return (int)node_->outputs.size();
+	}
+
+	const model::output_info& model::operation::output(int i) const
+	{
+		return node_->outputs.at(i);
+	}
+
+	TF_Operation* model::operation::get() const
+	{
+		return node_->op;
+	}
+
+	std::shared_ptr<const model::graph_index> model::get_index() const
+	{
+		auto current = std::atomic_load(index_.get());
+		if (current)
+		{
+			// Operations can be added to the graph after it was indexed (e.g. by a graph_builder)
+			size_t end = current->end;
+			if (TF_GraphNextOperation(graph_.get(), &end) == nullptr)
+				return current;
+		}
+
+		auto nodes = std::make_shared<std::vector<node_info>>();
+		auto by_name = std::make_shared<std::unordered_map<std::string, size_t>>();
+
+		size_t pos = 0;
+		TF_Operation* op;
+		while ((op = TF_GraphNextOperation(graph_.get(), &pos)) != nullptr)
+		{
+			by_name->emplace(TF_OperationName(op), nodes->size());
+			nodes->push_back(operation::read(graph_.get(), op));
+		}
+
+		auto created = std::make_shared<graph_index>();
+		created->nodes = nodes;
+		created->by_name = by_name;
+		created->end = pos;
+
+		// Several threads may race to build it, only the first one is kept
+		std::shared_ptr<const graph_index> built = created;
+		if (std::atomic_compare_exchange_strong(index_.get(), &current, built))
+			return built;
+		return current;
+	}
+
+	model::operations::iterator::iterator(std::shared_ptr<const std::vector<node_info>> nodes, size_t pos)
+		: nodes_(std::move(nodes))
+		, pos_(std::min(pos, nodes_->size()))
+	{}
+
+	model::operations::iterator model::operations::iterator::operator++()
+	{
+		if (pos_ < nodes_->size())
+			++pos_;
+		return *this;
+	}
+
+	model::operation model::operations::iterator::operator*()
+	{
+		// Shares the ownership of the index
+		return operation(std::shared_ptr<const node_info>(nodes_, &(*nodes_)[pos_]));
+	}
+
+	bool model::operations::iterator::operator!=(const iterator& iter)
+	{
+		return pos_ != iter.pos_;
+	}
+
+	bool model::operations::iterator::operator==(const iterator& iter)
+	{
+		return pos_ == iter.pos_;
+	}
+
+	model::operations::operations(model* _model)
+	{
+		auto index = _model->get_index();
+		nodes_ = index->nodes;
+		by_name_ = index->by_name;
+	}
+
+	model::operations::iterator model::operations::begin()
+	{
+		return operations::iterator(nodes_, 0);
+	}
+
+	model::operations::iterator model::operations::end()
+	{
+		return operations::iterator(nodes_, nodes_->size());
+	}
+
+	model::operations::iterator model::operations::find(const char* op)
+	{
+		auto it = by_name_->find(op);
+		return it == by_name_->end() ? end() : operations::iterator(nodes_, it->second);
+	}
+
+	size_t model::operations::size() const
+	{
+		return nodes_->size();
 	}
 }
 
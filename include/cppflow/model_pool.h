@@ -0,0 +1,339 @@
+//
+// Replicas of a model for concurrent inference
+//
+
+#ifndef CPPFLOW2_MODEL_POOL_H
+#define CPPFLOW2_MODEL_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "model.h"
+#include "tensor.h"
+
+namespace cppflow {
+
+    /**
+     * @class scoped_cpu_affinity
+     * @brief Restricts the calling thread to a set of CPUs until it goes out of scope
+     *
+     * Threads created meanwhile inherit the set, which is how the thread pools of a session created
+     * in the scope get pinned. Only supported on Linux, elsewhere it does nothing.
+     */
+    class scoped_cpu_affinity {
+    public:
+        /**
+         * @param cpus The CPUs to run on. Empty leaves the affinity unchanged
+         */
+        explicit scoped_cpu_affinity(const std::vector<int>& cpus);
+        ~scoped_cpu_affinity();
+
+        scoped_cpu_affinity(const scoped_cpu_affinity&)             = delete;
+        scoped_cpu_affinity& operator=(const scoped_cpu_affinity&)  = delete;
+
+    private:
+        bool changed_ = false;
+#if defined(__linux__)
+        cpu_set_t previous_;
+#endif
+    };
+
+    /**
+     * @struct model_pool_options
+     * @brief How a model_pool creates its replicas
+     */
+    struct model_pool_options {
+        /// Number of replicas
+        size_t replicas = 1;
+
+        /// Create the replicas as new sessions over the graph of the first one (model::replicate)
+        /// instead of loading the SavedModel again
+        bool share_graph = true;
+
+        /// Size of the inter-op thread pool owned by each replica session
+        int threads_per_replica = 1;
+
+        /// CPUs of each replica. The thread pools of its session are pinned to them once, when the
+        /// session is created
+        std::vector<std::vector<int>> cpu_sets;
+
+        /// Also pin the calling thread to the CPUs of the replica for the duration of each run() and
+        /// operator(). This costs two affinity changes per call and moves threads owned by the caller,
+        /// so it is only worth it for callers dedicated to the pool
+        bool pin_calling_thread = false;
+
+        /// Configuration of the replicas. use_per_session_threads is always set
+        model_options model;
+
+        /**
+         * @return cpu_sets assigning threads_per_replica consecutive CPUs to each replica
+         */
+        std::vector<std::vector<int>> consecutive_cpu_sets() const;
+    };
+
+    /**
+     * @class model_pool
+     * @brief Replicas of a model, each run through its own session
+     *
+     * Runs are dispatched to the replica with the fewest runs in flight, tracked with atomic counters,
+     * so callers never wait on a lock of the pool.
+     *
+     * With cpu_sets, the calling thread is pinned while each replica is created so its session thread
+     * pools inherit the set, then restored.
+     */
+    class model_pool {
+    public:
+        /**
+         * Loads the replicas, binding the inputs and outputs of the signature options.model.signature
+         */
+        model_pool(const std::string& filename, const model_pool_options& options);
+
+        /**
+         * Loads the replicas, binding the given graph tensors as inputs and outputs
+         */
+        model_pool(const std::string& filename, const std::vector<std::string>& inputs,
+                   const std::vector<std::string>& outputs, const model_pool_options& options);
+
+        /**
+         * @class lease
+         * @brief A replica reserved for a run, counted as in flight until the lease is destroyed
+         */
+        class lease {
+        public:
+            lease(lease&& other) noexcept;
+            lease& operator=(lease&&) = delete;
+            lease(const lease&) = delete;
+            lease& operator=(const lease&) = delete;
+            ~lease();
+
+            model& operator*() const;
+            model* operator->() const;
+
+            /**
+             * @return The position of the replica in the pool
+             */
+            size_t index() const { return this->index_; }
+
+        private:
+            friend class model_pool;
+            lease(model_pool* pool, size_t index) : pool_(pool), index_(index) {}
+
+            model_pool* pool_;
+            size_t index_;
+        };
+
+        /**
+         * Reserves the replica with the fewest runs in flight
+         */
+        lease acquire();
+
+        /**
+         * Runs the least loaded replica
+         * @return All the outputs of the model
+         */
+        model::output_set run(const std::vector<tensor>& inputs);
+
+        /**
+         * Runs the least loaded replica
+         * @return The first output of the model
+         */
+        tensor operator()(const std::vector<tensor>& inputs);
+
+        /**
+         * @return Number of replicas
+         */
+        size_t size() const;
+
+        /**
+         * @return Replica i, to run it or to read its signatures
+         */
+        model& replica(size_t i);
+
+        /**
+         * @return Number of runs in flight on replica i
+         */
+        size_t in_flight(size_t i) const;
+
+        /**
+         * @return Number of runs dispatched to replica i
+         */
+        uint64_t runs(size_t i) const;
+
+    private:
+        struct replica_state {
+            std::unique_ptr<model> instance;
+            std::vector<int> cpus;
+            std::atomic<size_t> in_flight{0};
+            std::atomic<uint64_t> runs{0};
+        };
+
+        template<typename Load>
+        void create(const model_pool_options& options, Load load);
+
+        std::vector<std::unique_ptr<replica_state>> replicas_;
+        std::atomic<size_t> next_{0};
+        bool pin_calling_thread_ = false;
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    scoped_cpu_affinity::scoped_cpu_affinity(const std::vector<int>& cpus) {
+#if defined(__linux__)
+        if (cpus.empty())
+            return;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : cpus)
+            CPU_SET(cpu, &set);
+
+        if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &this->previous_) != 0)
+            throw std::runtime_error{"Could not read the CPU affinity of the thread"};
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0)
+            throw std::runtime_error{"Could not set the CPU affinity of the thread"};
+        this->changed_ = true;
+#else
+        (void)cpus;
+#endif
+    }
+
+    scoped_cpu_affinity::~scoped_cpu_affinity() {
+#if defined(__linux__)
+        if (this->changed_)
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &this->previous_);
+#endif
+    }
+
+    std::vector<std::vector<int>> model_pool_options::consecutive_cpu_sets() const {
+        std::vector<std::vector<int>> sets(this->replicas);
+        int cpu = 0;
+        for (auto& set : sets)
+            for (int i = 0; i < this->threads_per_replica; i++)
+                set.push_back(cpu++);
+        return sets;
+    }
+
+    model_pool::model_pool(const std::string& filename, const model_pool_options& options) {
+        this->create(options, [&](const model_options& replica_options) {
+            return model(filename, replica_options);
+        });
+    }
+
+    model_pool::model_pool(const std::string& filename, const std::vector<std::string>& inputs,
+                           const std::vector<std::string>& outputs, const model_pool_options& options) {
+        this->create(options, [&](const model_options& replica_options) {
+            return model(filename, inputs, outputs, replica_options);
+        });
+    }
+
+    template<typename Load>
+    void model_pool::create(const model_pool_options& options, Load load) {
+        if (options.replicas == 0)
+            throw std::runtime_error{"A model pool needs at least one replica"};
+        if (!options.cpu_sets.empty() && options.cpu_sets.size() != options.replicas)
+            throw std::runtime_error{"cpu_sets must have one entry per replica"};
+
+        this->pin_calling_thread_ = options.pin_calling_thread;
+
+        auto replica_options = options.model;
+        replica_options.use_per_session_threads = true;
+        if (replica_options.inter_op_threads == 0)
+            replica_options.inter_op_threads = options.threads_per_replica;
+
+        for (size_t i = 0; i < options.replicas; i++) {
+            auto state = std::unique_ptr<replica_state>(new replica_state());
+            if (!options.cpu_sets.empty())
+                state->cpus = options.cpu_sets[i];
+
+            // The session thread pools are created here, and inherit the affinity
+            scoped_cpu_affinity affinity(state->cpus);
+            if (i == 0 || !options.share_graph)
+                state->instance.reset(new model(load(replica_options)));
+            else
+                state->instance.reset(new model(this->replicas_[0]->instance->replicate(replica_options)));
+
+            this->replicas_.push_back(std::move(state));
+        }
+    }
+
+    model_pool::lease model_pool::acquire() {
+        // Start from a rotating position so equally loaded replicas take turns
+        auto n = this->replicas_.size();
+        auto start = this->next_.fetch_add(1, std::memory_order_relaxed) % n;
+
+        auto best = start;
+        auto best_load = this->replicas_[start]->in_flight.load(std::memory_order_relaxed);
+        for (size_t k = 1; k < n && best_load > 0; k++) {
+            auto i = (start + k) % n;
+            auto load = this->replicas_[i]->in_flight.load(std::memory_order_relaxed);
+            if (load < best_load) {
+                best = i;
+                best_load = load;
+            }
+        }
+
+        this->replicas_[best]->in_flight.fetch_add(1, std::memory_order_relaxed);
+        this->replicas_[best]->runs.fetch_add(1, std::memory_order_relaxed);
+        return lease(this, best);
+    }
+
+    model::output_set model_pool::run(const std::vector<tensor>& inputs) {
+        auto replica = this->acquire();
+        scoped_cpu_affinity affinity(this->pin_calling_thread_ ? this->replicas_[replica.index()]->cpus : std::vector<int>());
+        return replica->run(inputs);
+    }
+
+    tensor model_pool::operator()(const std::vector<tensor>& inputs) {
+        auto replica = this->acquire();
+        scoped_cpu_affinity affinity(this->pin_calling_thread_ ? this->replicas_[replica.index()]->cpus : std::vector<int>());
+        return (*replica)(inputs);
+    }
+
+    size_t model_pool::size() const {
+        return this->replicas_.size();
+    }
+
+    model& model_pool::replica(size_t i) {
+        return *this->replicas_[i]->instance;
+    }
+
+    size_t model_pool::in_flight(size_t i) const {
+        return this->replicas_[i]->in_flight.load(std::memory_order_relaxed);
+    }
+
+    uint64_t model_pool::runs(size_t i) const {
+        return this->replicas_[i]->runs.load(std::memory_order_relaxed);
+    }
+
+    model_pool::lease::lease(lease&& other) noexcept : pool_(other.pool_), index_(other.index_) {
+        other.pool_ = nullptr;
+    }
+
+    model_pool::lease::~lease() {
+        if (this->pool_ != nullptr)
+            this->pool_->replicas_[this->index_]->in_flight.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    model& model_pool::lease::operator*() const {
+        return *this->pool_->replicas_[this->index_]->instance;
+    }
+
+    model* model_pool::lease::operator->() const {
+        return this->pool_->replicas_[this->index_]->instance.get();
+    }
+}
+
+#endif //CPPFLOW2_MODEL_POOL_H
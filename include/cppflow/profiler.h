@@ -0,0 +1,338 @@
+//
+// Step statistics of sampled model runs
+//
+
+#ifndef CPPFLOW2_PROFILER_H
+#define CPPFLOW2_PROFILER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tensorflow/c/c_api.h>
+
+#include "proto.h"
+
+namespace cppflow {
+
+    /**
+     * @struct profiler_options
+     * @brief How often runs are traced and how many traces are kept
+     */
+    struct profiler_options {
+        /// Trace one run out of sample_every
+        uint64_t sample_every = 100;
+
+        /// Number of traced runs kept for the Chrome trace. The latency table covers all of them
+        size_t max_traces = 16;
+    };
+
+    /**
+     * @struct node_stats
+     * @brief Execution of a graph node in a traced run
+     */
+    struct node_stats {
+        std::string device;
+        std::string node_name;
+        std::string op_type;
+
+        /// Start time since the epoch, in microseconds
+        int64_t start_us = 0;
+
+        /// Time from the scheduling of the node to the end of its outputs, in microseconds
+        int64_t duration_us = 0;
+
+        int64_t thread_id = 0;
+    };
+
+    /**
+     * @struct op_latency
+     * @brief Aggregated time of all the nodes of an op type
+     */
+    struct op_latency {
+        std::string op_type;
+        uint64_t count = 0;
+        double total_us = 0;
+        double max_us = 0;
+
+        double mean_us() const { return count == 0 ? 0.0 : total_us / double(count); }
+    };
+
+    /**
+     * @class profiler
+     * @brief Collects the StepStats of sampled runs
+     *
+     * Attached to a model with model::enable_profiling(). Runs that are not sampled only pay for a
+     * counter increment; sampled runs are executed with FULL_TRACE and their RunMetadata parsed.
+     */
+    class profiler {
+    public:
+        explicit profiler(const profiler_options& options = profiler_options());
+
+        /**
+         * Counts a run, for runs traced outside of a model. A model samples with its own counter
+         * @return True if this run must be traced
+         */
+        bool sample();
+
+        /**
+         * Parses the StepStats of a traced run
+         * @param run_metadata The serialized RunMetadata returned by TF_SessionRun
+         * @param graph The graph that was run, to find the op type of the nodes
+         */
+        void record(const TF_Buffer* run_metadata, TF_Graph* graph);
+
+        /**
+         * @return Number of traced runs
+         */
+        uint64_t traced_runs() const;
+
+        /**
+         * @return The nodes executed by the last max_traces traced runs
+         */
+        std::vector<std::vector<node_stats>> traces() const;
+
+        /**
+         * @return The time spent per op type over all the traced runs, the most expensive first
+         */
+        std::vector<op_latency> op_table() const;
+
+        /**
+         * @return op_table() as aligned text
+         */
+        std::string format_op_table() const;
+
+        /**
+         * @return The kept traces in the Chrome trace event format (chrome://tracing, Perfetto)
+         */
+        std::string chrome_trace() const;
+
+        /**
+         * Writes chrome_trace() to a file
+         * @throws std::runtime_error If the file can not be written
+         */
+        void write_chrome_trace(const std::string& filename) const;
+
+    private:
+        std::string op_type(const std::string& node_name, const std::string& timeline_label, TF_Graph* graph);
+        static std::string escape(const std::string& s);
+
+        profiler_options options_;
+        std::atomic<uint64_t> runs_{0};
+
+        mutable std::mutex mutex_;
+        uint64_t traced_ = 0;
+        std::deque<std::vector<node_stats>> traces_;
+        std::map<std::string, op_latency> ops_;
+        std::unordered_map<std::string, std::string> op_types_;
+    };
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    profiler::profiler(const profiler_options& options) : options_(options) {
+        if (this->options_.sample_every == 0)
+            throw std::runtime_error{"sample_every must be positive"};
+    }
+
+    bool profiler::sample() {
+        return this->runs_.fetch_add(1, std::memory_order_relaxed) % this->options_.sample_every == 0;
+    }
+
+    void profiler::record(const TF_Buffer* run_metadata, TF_Graph* graph) {
+        std::vector<node_stats> nodes;
+
+        std::lock_guard<std::mutex> lock(this->mutex_);
+
+        // RunMetadata: step_stats = 1. StepStats: dev_stats = 1
+        proto::reader metadata(run_metadata->data, run_metadata->length);
+        while (metadata.next()) {
+            if (metadata.field() != 1)
+                continue;
+
+            auto step_stats = metadata.message();
+            while (step_stats.next()) {
+                if (step_stats.field() != 1)
+                    continue;
+
+                // DeviceStepStats: device = 1, node_stats = 2
+                std::string device;
+                auto dev_stats = step_stats.message();
+                while (dev_stats.next()) {
+                    if (dev_stats.field() == 1) {
+                        device = dev_stats.bytes();
+                        continue;
+                    }
+                    if (dev_stats.field() != 2)
+                        continue;
+
+                    // NodeExecStats: node_name = 1, all_start_micros = 2, all_end_rel_micros = 5,
+                    // timeline_label = 8, thread_id = 10
+                    node_stats node;
+                    std::string label;
+                    auto stats = dev_stats.message();
+                    while (stats.next()) {
+                        switch (stats.field()) {
+                            case 1: node.node_name = stats.bytes(); break;
+                            case 2: node.start_us = stats.varint(); break;
+                            case 5: node.duration_us = stats.varint(); break;
+                            case 8: label = stats.bytes(); break;
+                            case 10: node.thread_id = stats.varint(); break;
+                            default: break;
+                        }
+                    }
+                    node.device = device;
+                    node.op_type = this->op_type(node.node_name, label, graph);
+                    nodes.push_back(std::move(node));
+                }
+            }
+        }
+
+        for (auto& node : nodes) {
+            auto& op = this->ops_[node.op_type];
+            op.op_type = node.op_type;
+            op.count++;
+            op.total_us += double(node.duration_us);
+            op.max_us = std::max(op.max_us, double(node.duration_us));
+        }
+
+        this->traced_++;
+        this->traces_.push_back(std::move(nodes));
+        while (this->traces_.size() > this->options_.max_traces)
+            this->traces_.pop_front();
+    }
+
+    uint64_t profiler::traced_runs() const {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        return this->traced_;
+    }
+
+    std::vector<std::vector<node_stats>> profiler::traces() const {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        return std::vector<std::vector<node_stats>>(this->traces_.begin(), this->traces_.end());
+    }
+
+    std::vector<op_latency> profiler::op_table() const {
+        std::vector<op_latency> table;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            for (auto& entry : this->ops_)
+                table.push_back(entry.second);
+        }
+
+        std::sort(table.begin(), table.end(), [](const op_latency& a, const op_latency& b) { return a.total_us > b.total_us; });
+        return table;
+    }
+
+    std::string profiler::format_op_table() const {
+        auto table = this->op_table();
+
+        double total = 0;
+        for (auto& op : table)
+            total += op.total_us;
+
+        std::ostringstream out;
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-32s %10s %12s %10s %10s %7s\n", "op", "count", "total(us)", "mean(us)", "max(us)", "%");
+        out << line;
+        for (auto& op : table) {
+            std::snprintf(line, sizeof(line), "%-32s %10llu %12.0f %10.1f %10.0f %6.1f%%\n", op.op_type.c_str(),
+                          (unsigned long long)op.count, op.total_us, op.mean_us(), op.max_us, total > 0 ? 100.0 * op.total_us / total : 0.0);
+            out << line;
+        }
+        return out.str();
+    }
+
+    std::string profiler::chrome_trace() const {
+        auto traces = this->traces();
+
+        // One process per device
+        std::map<std::string, int> pids;
+        for (auto& trace : traces)
+            for (auto& node : trace)
+                pids.emplace(node.device, (int)pids.size());
+
+        std::ostringstream out;
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        for (auto& entry : pids) {
+            out << (first ? "" : ",") << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << entry.second
+                << ",\"args\":{\"name\":\"" << escape(entry.first) << "\"}}";
+            first = false;
+        }
+        for (auto& trace : traces) {
+            for (auto& node : trace) {
+                out << (first ? "" : ",") << "{\"name\":\"" << escape(node.node_name) << "\",\"cat\":\"" << escape(node.op_type)
+                    << "\",\"ph\":\"X\",\"ts\":" << node.start_us << ",\"dur\":" << node.duration_us
+                    << ",\"pid\":" << pids[node.device] << ",\"tid\":" << node.thread_id
+                    << ",\"args\":{\"op\":\"" << escape(node.op_type) << "\"}}";
+                first = false;
+            }
+        }
+        out << "]}";
+        return out.str();
+    }
+
+    void profiler::write_chrome_trace(const std::string& filename) const {
+        std::ofstream file(filename);
+        file << this->chrome_trace();
+        if (!file)
+            throw std::runtime_error{"Could not write " + filename};
+    }
+
+    std::string profiler::op_type(const std::string& node_name, const std::string& timeline_label, TF_Graph* graph) {
+        auto it = this->op_types_.find(node_name);
+        if (it != this->op_types_.end())
+            return it->second;
+
+        std::string type;
+        TF_Operation* oper = TF_GraphOperationByName(graph, node_name.c_str());
+        if (oper != nullptr) {
+            type = TF_OperationOpType(oper);
+        } else {
+            // Nodes of functions are not in the graph. Their label reads "name = OpType(inputs)"
+            auto eq = timeline_label.find(" = ");
+            auto paren = timeline_label.find('(', eq == std::string::npos ? 0 : eq);
+            if (eq != std::string::npos && paren != std::string::npos)
+                type = timeline_label.substr(eq + 3, paren - eq - 3);
+            else if (node_name.find(':') != std::string::npos)
+                type = node_name.substr(node_name.rfind(':') + 1); // "name:OpType" in recent versions
+            else
+                type = node_name;
+        }
+
+        this->op_types_.emplace(node_name, type);
+        return type;
+    }
+
+    std::string profiler::escape(const std::string& s) {
+        std::string escaped;
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if ((unsigned char)c < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", c);
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+}
+
+#endif //CPPFLOW2_PROFILER_H
@@ -0,0 +1,245 @@
+//
+// Protocol buffer wire format helpers
+//
+
+#ifndef CPPFLOW2_PROTO_H
+#define CPPFLOW2_PROTO_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace cppflow {
+
+    namespace proto {
+
+        /**
+         * @class writer
+         * @brief Minimal protobuf wire format encoder
+         *
+         * The TensorFlow C API only accepts configuration (ConfigProto, RunOptions...) as serialized
+         * protocol buffers. This writer covers the handful of field kinds needed to build them without
+         * depending on libprotobuf. Serialized messages can be concatenated: the parser merges them,
+         * with later scalar fields overriding earlier ones.
+         */
+        class writer {
+        public:
+            /**
+             * Writes an integer/enum field (negative values are encoded as 64-bit two's complement)
+             */
+            writer& varint(int field, int64_t value);
+
+            /**
+             * Writes a boolean field
+             */
+            writer& boolean(int field, bool value);
+
+            /**
+             * Writes a string/bytes field
+             */
+            writer& bytes(int field, const std::string& value);
+
+            /**
+             * Writes an embedded message field
+             */
+            writer& message(int field, const writer& value);
+
+            /**
+             * Appends an already serialized message of the same type
+             */
+            writer& merge(const std::string& serialized);
+
+            /**
+             * @return The serialized message
+             */
+            const std::string& str() const;
+
+            /**
+             * @return True if no field has been written
+             */
+            bool empty() const;
+
+        private:
+            void tag(int field, int wire_type);
+            void raw_varint(uint64_t value);
+
+            std::string buffer_;
+        };
+
+        /**
+         * @class reader
+         * @brief Minimal protobuf wire format decoder
+         *
+         * Iterates over the fields of a serialized message, used to read the messages returned by the
+         * TensorFlow C API (MetaGraphDef, RunMetadata...). The reader does not copy the data, which must
+         * outlive it. Unknown fields are simply skipped by calling next().
+         */
+        class reader {
+        public:
+            reader(const void* data, size_t size);
+
+            /**
+             * Moves to the next field
+             * @return False at the end of the message
+             * @throws std::runtime_error If the message is malformed
+             */
+            bool next();
+
+            /**
+             * @return Number of the current field
+             */
+            int field() const { return this->field_; }
+
+            /**
+             * @return The value of the current integer/enum/bool field
+             */
+            int64_t varint() const { return static_cast<int64_t>(this->value_); }
+
+            /**
+             * @return The value of the current fixed64/double field, as raw bits
+             */
+            uint64_t fixed64() const { return this->value_; }
+
+            /**
+             * @return The value of the current string/bytes field
+             */
+            std::string bytes() const { return std::string(this->data_, this->size_); }
+
+            /**
+             * @return A reader over the current embedded message field
+             */
+            reader message() const { return reader(this->data_, this->size_); }
+
+            /**
+             * @return True if the current field is length-delimited (string, bytes, message or packed list)
+             */
+            bool length_delimited() const { return this->wire_type_ == 2; }
+
+        private:
+            uint64_t read_varint();
+
+            const char* pos_;
+            const char* end_;
+
+            int field_ = 0;
+            int wire_type_ = 0;
+            uint64_t value_ = 0;
+            const char* data_ = nullptr;
+            size_t size_ = 0;
+        };
+    }
+}
+
+/******************************
+ *   IMPLEMENTATION DETAILS   *
+ ******************************/
+
+namespace cppflow {
+
+    namespace proto {
+
+        writer& writer::varint(int field, int64_t value) {
+            this->tag(field, 0);
+            this->raw_varint(static_cast<uint64_t>(value));
+            return *this;
+        }
+
+        writer& writer::boolean(int field, bool value) {
+            return this->varint(field, value ? 1 : 0);
+        }
+
+        writer& writer::bytes(int field, const std::string& value) {
+            this->tag(field, 2);
+            this->raw_varint(value.size());
+            this->buffer_.append(value);
+            return *this;
+        }
+
+        writer& writer::message(int field, const writer& value) {
+            return this->bytes(field, value.str());
+        }
+
+        writer& writer::merge(const std::string& serialized) {
+            this->buffer_.append(serialized);
+            return *this;
+        }
+
+        const std::string& writer::str() const {
+            return this->buffer_;
+        }
+
+        bool writer::empty() const {
+            return this->buffer_.empty();
+        }
+
+        void writer::tag(int field, int wire_type) {
+            this->raw_varint((static_cast<uint64_t>(field) << 3) | static_cast<uint64_t>(wire_type));
+        }
+
+        void writer::raw_varint(uint64_t value) {
+            while (value >= 0x80) {
+                this->buffer_.push_back(static_cast<char>((value & 0x7F) | 0x80));
+                value >>= 7;
+            }
+            this->buffer_.push_back(static_cast<char>(value));
+        }
+
+        reader::reader(const void* data, size_t size)
+            : pos_(static_cast<const char*>(data)), end_(static_cast<const char*>(data) + size) {}
+
+        bool reader::next() {
+            if (this->pos_ >= this->end_)
+                return false;
+
+            auto key = this->read_varint();
+            this->field_ = static_cast<int>(key >> 3);
+            this->wire_type_ = static_cast<int>(key & 7);
+            this->value_ = 0;
+            this->data_ = nullptr;
+            this->size_ = 0;
+
+            switch (this->wire_type_) {
+                case 0:
+                    this->value_ = this->read_varint();
+                    break;
+                case 1:
+                case 5: {
+                    size_t n = this->wire_type_ == 1 ? 8 : 4;
+                    if ((size_t)(this->end_ - this->pos_) < n)
+                        throw std::runtime_error{"Malformed protocol buffer: truncated fixed field"};
+                    std::memcpy(&this->value_, this->pos_, n); // Little endian, as on every platform TensorFlow supports
+                    this->pos_ += n;
+                    break;
+                }
+                case 2: {
+                    auto n = this->read_varint();
+                    if (n > (uint64_t)(this->end_ - this->pos_))
+                        throw std::runtime_error{"Malformed protocol buffer: truncated length-delimited field"};
+                    this->data_ = this->pos_;
+                    this->size_ = (size_t)n;
+                    this->pos_ += n;
+                    break;
+                }
+                default:
+                    throw std::runtime_error{"Malformed protocol buffer: unsupported wire type " + std::to_string(this->wire_type_)};
+            }
+            return true;
+        }
+
+        uint64_t reader::read_varint() {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (this->pos_ >= this->end_)
+                    throw std::runtime_error{"Malformed protocol buffer: truncated varint"};
+                auto byte = static_cast<uint8_t>(*this->pos_++);
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0)
+                    return value;
+            }
+            throw std::runtime_error{"Malformed protocol buffer: varint too long"};
+        }
+    }
+}
+
+#endif //CPPFLOW2_PROTO_H
@@ -5,6 +5,9 @@
 #ifndef CPPFLOW2_TENSOR_H
 #define CPPFLOW2_TENSOR_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <cstring>
@@ -12,11 +15,132 @@
 #include <tensorflow/c/tf_tensor.h>
 #include <tensorflow/c/eager/c_api.h>
 
+#include "allocator.h"
 #include "context.h"
 #include "datatype.h"
 
 namespace cppflow {
 
+    /**
+     * @class dim_vector
+     * @brief The dimensions of a tensor, stored inline (without heap allocation) up to max_inline_dims
+     */
+    class dim_vector {
+    public:
+        static constexpr size_t max_inline_dims = 8;
+
+        dim_vector() = default;
+
+        /**
+         * Creates rank dimensions initialized to 0
+         */
+        explicit dim_vector(size_t rank);
+
+        int64_t* data() { return this->size_ <= max_inline_dims ? this->inline_.data() : this->heap_.data(); }
+        const int64_t* data() const { return this->size_ <= max_inline_dims ? this->inline_.data() : this->heap_.data(); }
+
+        size_t size() const { return this->size_; }
+        bool empty() const { return this->size_ == 0; }
+
+        int64_t* begin() { return this->data(); }
+        int64_t* end() { return this->data() + this->size_; }
+        const int64_t* begin() const { return this->data(); }
+        const int64_t* end() const { return this->data() + this->size_; }
+
+        int64_t& operator[](size_t i) { return this->data()[i]; }
+        const int64_t& operator[](size_t i) const { return this->data()[i]; }
+
+        bool operator==(const dim_vector& other) const;
+        bool operator!=(const dim_vector& other) const { return !(*this == other); }
+
+        /**
+         * @return The dimensions as a std::vector, as taken by the tensor constructors
+         */
+        std::vector<int64_t> to_vector() const { return std::vector<int64_t>(this->begin(), this->end()); }
+
+    private:
+        size_t size_ = 0;
+        std::array<int64_t, max_inline_dims> inline_{};
+        std::vector<int64_t> heap_;
+    };
+
+    /**
+     * @class tensor_view
+     * @brief A non-owning, bounds-aware view over the host data of a tensor
+     *
+     * Obtained with tensor::view<T>(). Elements are read in place, in row-major order.
+     * @tparam T The c++ type of the elements (must be equivalent to the tensor type)
+     */
+    template<typename T>
+    class tensor_view {
+    public:
+        using value_type = T;
+        using iterator = T*;
+
+        tensor_view() = default;
+
+        tensor_view(std::shared_ptr<TF_Tensor> holder, T* data, size_t size, std::vector<int64_t> shape);
+
+        /**
+         * Creates a view over the data of t
+         * @param holder Keeps t alive while the view exists, may be null if the caller guarantees it
+         * @param t The tensor to view
+         * @throws std::runtime_error If T does not match the datatype of t
+         */
+        tensor_view(std::shared_ptr<TF_Tensor> holder, TF_Tensor* t);
+
+        /**
+         * @return Pointer to the first element
+         */
+        T* data() const { return this->data_; }
+
+        /**
+         * @return Number of elements
+         */
+        size_t size() const { return this->size_; }
+
+        bool empty() const { return this->size_ == 0; }
+
+        /**
+         * @return Number of dimensions
+         */
+        int rank() const { return (int)this->shape_.size(); }
+
+        /**
+         * @return The dimensions of the tensor
+         */
+        const std::vector<int64_t>& shape() const { return this->shape_; }
+
+        /**
+         * @return The distance, in elements, between two consecutive indices of each dimension
+         */
+        const std::vector<int64_t>& strides() const { return this->strides_; }
+
+        T* begin() const { return this->data_; }
+        T* end() const { return this->data_ + this->size_; }
+
+        T& operator[](size_t i) const { return this->data_[i]; }
+
+        /**
+         * @return The element at flat position i
+         * @throws std::out_of_range If i is not lower than size()
+         */
+        T& at(size_t i) const;
+
+        /**
+         * @return The element at the given multidimensional index
+         * @throws std::out_of_range If the index does not match the shape
+         */
+        T& at(const std::vector<int64_t>& index) const;
+
+    private:
+        std::shared_ptr<TF_Tensor> holder_;
+        T* data_ = nullptr;
+        size_t size_ = 0;
+        std::vector<int64_t> shape_;
+        std::vector<int64_t> strides_;
+    };
+
     /**
      * @class tensor
      * @brief A TensorFlow eager tensor wrapper
@@ -67,11 +191,78 @@ namespace cppflow {
 		template<typename T>
         tensor(const std::vector<T>& values);
 
+        /**
+         * Creates a tensor taking ownership of the storage of values, without copying it
+         * The storage is only adopted when it is aligned to tensor_alignment (always true with
+         * aligned_allocator), otherwise the values are copied into a new buffer.
+         * @tparam T A type that can be convertible into a tensor
+         * @param values The values to be moved (in a flattened version)
+         * @param shape The shape of the tensor
+         */
+        template<typename T, typename Allocator>
+        tensor(std::vector<T, Allocator>&& values, const std::vector<int64_t>& shape);
+
+        /**
+         * Creates a flat tensor taking ownership of the storage of values, without copying it
+         * @tparam T A type that can be convertible into a tensor
+         * @param values The values to be moved
+         */
+        template<typename T, typename Allocator>
+        tensor(std::vector<T, Allocator>&& values);
+
+        /**
+         * Creates a tensor using a caller-owned buffer in place, without copying it
+         * @param type The datatype of the elements in data
+         * @param data The buffer, it must be aligned to tensor_alignment bytes
+         * @param len The size of the buffer in bytes
+         * @param shape The shape of the tensor
+         * @param deallocator Called with (data, len, deallocator_arg) once TensorFlow no longer uses the buffer.
+         * If the buffer is rejected (not aligned, or smaller than the shape needs) it is not called and the
+         * caller keeps the ownership of data. Once the buffer is accepted it is always called, even if the
+         * constructor throws afterwards
+         * @param deallocator_arg Extra argument passed to deallocator
+         */
+        tensor(datatype type, void* data, size_t len, const std::vector<int64_t>& shape,
+               void (*deallocator)(void* data, size_t len, void* arg), void* deallocator_arg);
+
+        /**
+         * Creates a tensor using a buffer in place, without copying it, keeping owner alive as long as
+         * TensorFlow uses the buffer
+         * @param type The datatype of the elements in data
+         * @param owner The object owning the buffer
+         * @param data The buffer, it must be aligned to tensor_alignment bytes
+         * @param len The size of the buffer in bytes
+         * @param shape The shape of the tensor
+         */
+        tensor(datatype type, std::shared_ptr<void> owner, void* data, size_t len, const std::vector<int64_t>& shape);
+
         /**
          * @return Shape of the tensor
          */
         tensor shape() const;
 
+        /**
+         * Reads the dimensions from the tensor handle metadata, without executing any op
+         * @return The dimensions of the tensor
+         */
+        dim_vector dims() const;
+
+        /**
+         * Same as dims(), but the dimensions are only read on the first call on this tensor
+         * @return The dimensions of the tensor
+         */
+        const dim_vector& cached_dims() const;
+
+        /**
+         * @return Number of dimensions of the tensor
+         */
+        int rank() const;
+
+        /**
+         * @return Number of elements of the tensor
+         */
+        int64_t num_elements() const;
+
         /**
          * @param on_memory If false, the function will return the name of the device that produced the tensor.
          * If true, the function will return the name of the device in whose memory the tensor resides
@@ -98,27 +289,76 @@ namespace cppflow {
         template<typename T>
         std::vector<T> data() const;
 
+        /**
+         * Gives access to the tensor data in place, without copying it
+         * @tparam T The c++ type (must be equivalent to the tensor type), may be const
+         * @return A view over the flat tensor data, valid while the tensor lives
+         * @throws std::runtime_error If T does not match the tensor datatype
+         */
+        template<typename T>
+        tensor_view<T> view() const;
+
         /*
         *  raw data
         */
         void* data() const;
 
+        /**
+         * Resolves the tensor into host memory. The result is kept in tf_tensor, so only the
+         * first call on a tensor resolves it
+         * @return The TF_Tensor holding the data of the tensor
+         */
+        std::shared_ptr<TF_Tensor> get_tensor() const;
+
+        /**
+         * @return Number of times a tensor handle has been resolved into host memory by get_tensor()
+         */
+        static uint64_t resolve_count();
+
+        /**
+         * @return Number of bytes taken by a tensor of fixed-size elements of the given type and shape
+         * @throws std::runtime_error If a dimension is negative (unknown)
+         */
+        static size_t byte_size(datatype type, const std::vector<int64_t>& shape);
+
         ~tensor() = default;
-        tensor(const tensor &tensor) = default;
-        tensor(tensor &&tensor) = default;
-        tensor &operator=(const tensor &other) = default;
-        tensor &operator=(tensor &&other) = default;
 
+        // The resolved caches may be filled by get_tensor() or dims() from another thread, so they are copied atomically
+        tensor(const tensor &tensor);
+        tensor(tensor &&tensor) noexcept;
+        tensor &operator=(const tensor &other);
+        tensor &operator=(tensor &&other) noexcept;
 
-        std::shared_ptr<TF_Tensor> tf_tensor;
         std::shared_ptr<TFE_TensorHandle> tfe_handle;
 
+        // Node producing this tensor in a graph being built (see graph_builder). Such a symbolic
+        // tensor has no tfe_handle and no value
+        TF_Output tf_output{nullptr, 0};
+
+        /**
+         * @return True if the tensor is an output of a graph being built rather than a value
+         */
+        bool symbolic() const { return this->tf_output.oper != nullptr; }
+
+    private:
+        // Host tensor backing tfe_handle, set at construction or on the first get_tensor()
+        mutable std::shared_ptr<TF_Tensor> tf_tensor;
+        mutable std::shared_ptr<const dim_vector> dims_;
+
+    public:
+
         explicit tensor(TFE_TensorHandle* handle);
         explicit tensor(TF_Tensor* t);
+        explicit tensor(std::shared_ptr<TF_Tensor> t);
 
     private:
 
         tensor(enum TF_DataType type, const void* data, size_t len, const std::vector<int64_t>& shape);
+
+        static std::atomic<uint64_t>& resolves() {
+            static std::atomic<uint64_t> resolves{0};
+            return resolves;
+        }
     };
 }
 
@@ -131,8 +371,24 @@ namespace cppflow {
 namespace cppflow {
 
     tensor::tensor(enum TF_DataType type, const void *data, size_t len, const std::vector<int64_t> &shape) {
-        this->tf_tensor = {TF_AllocateTensor(type, shape.data(), (int)shape.size(), (int)len), TF_DeleteTensor};
-        std::memcpy(TF_TensorData(this->tf_tensor.get()), data, TF_TensorByteSize(this->tf_tensor.get()));
+        if (type == TF_STRING) {
+            this->tf_tensor = {TF_AllocateTensor(type, shape.data(), (int)shape.size(), (int)len), TF_DeleteTensor};
+            std::memcpy(TF_TensorData(this->tf_tensor.get()), data, TF_TensorByteSize(this->tf_tensor.get()));
+        } else {
+            if (len < byte_size(type, shape))
+                throw std::runtime_error{"Data is too small for the requested shape"};
+
+            // Draw the buffer from the pool, TF gives it back through the deallocator on every path
+            auto& pool = buffer_pool::global();
+            auto buffer = pool.allocate(len);
+            if (len > 0)
+                std::memcpy(buffer, data, len);
+
+            auto t = TF_NewTensor(type, shape.data(), (int)shape.size(), buffer, len, buffer_pool::tensor_deallocator, &pool);
+            if (t == nullptr)
+                throw std::runtime_error{"Data is too small for the requested shape"};
+            this->tf_tensor = {t, TF_DeleteTensor};
+        }
         this->tfe_handle = {TFE_NewTensorHandle(this->tf_tensor.get(), context::get_status()), TFE_DeleteTensorHandle};
         status_check(context::get_status());
     }
@@ -141,6 +397,56 @@ namespace cppflow {
     tensor::tensor(const std::vector<T>& values, const std::vector<int64_t>& shape) :
         tensor(deduce_tf_type<T>(), values.data(), values.size() * sizeof(T), shape) {}
 
+    template<typename T, typename Allocator>
+    tensor::tensor(std::vector<T, Allocator>&& values, const std::vector<int64_t>& shape) {
+        static_assert(!std::is_same<T, bool>::value, "std::vector<bool> has no contiguous storage");
+
+        if (values.empty() || !is_aligned(values.data())) {
+            *this = tensor(deduce_tf_type<T>(), values.data(), values.size() * sizeof(T), shape);
+            return;
+        }
+
+        // Rejected before TF owns the storage, so the values are left untouched
+        if (values.size() * sizeof(T) < byte_size(deduce_tf_type<T>(), shape))
+            throw std::runtime_error{"Data is too small for the requested shape"};
+
+        // From here on the deallocator releases the storage, on every path
+        auto* storage = new std::vector<T, Allocator>(std::move(values));
+        auto deallocator = [](void*, size_t, void* arg) { delete static_cast<std::vector<T, Allocator>*>(arg); };
+        *this = tensor(deduce_tf_type<T>(), storage->data(), storage->size() * sizeof(T), shape, deallocator, storage);
+    }
+
+    template<typename T, typename Allocator>
+    tensor::tensor(std::vector<T, Allocator>&& values) :
+        tensor(std::move(values), {(int64_t)values.size()}) {}
+
+    tensor::tensor(datatype type, void* data, size_t len, const std::vector<int64_t>& shape,
+                   void (*deallocator)(void* data, size_t len, void* arg), void* deallocator_arg) {
+        if (!is_aligned(data))
+            throw std::runtime_error{"Buffer is not aligned to " + std::to_string(tensor_alignment) + " bytes, TensorFlow would copy it"};
+        if (len < byte_size(type, shape))
+            throw std::runtime_error{"Buffer is too small for the requested shape"};
+
+        // TF_NewTensor takes the buffer: it calls the deallocator itself if it fails
+        auto t = TF_NewTensor(type, shape.data(), (int)shape.size(), data, len, deallocator, deallocator_arg);
+        if (t == nullptr)
+            throw std::runtime_error{"Buffer is too small for the requested shape"};
+
+        *this = tensor(t);
+    }
+
+    tensor::tensor(datatype type, std::shared_ptr<void> owner, void* data, size_t len, const std::vector<int64_t>& shape) {
+        if (!is_aligned(data))
+            throw std::runtime_error{"Buffer is not aligned to " + std::to_string(tensor_alignment) + " bytes, TensorFlow would copy it"};
+        if (len < byte_size(type, shape))
+            throw std::runtime_error{"Buffer is too small for the requested shape"};
+
+        // The deallocator releases keep_alive on every path once the buffer is accepted
+        auto* keep_alive = new std::shared_ptr<void>(std::move(owner));
+        auto deallocator = [](void*, size_t, void* arg) { delete static_cast<std::shared_ptr<void>*>(arg); };
+        *this = tensor(type, data, len, shape, deallocator, keep_alive);
+    }
+
     template<typename T>
     tensor::tensor(const std::initializer_list<T>& values) :
         tensor(std::vector<T>(values), {(int64_t)values.size()}) {}
@@ -182,15 +488,19 @@ namespace cppflow {
             this->tfe_handle = {handle, TFE_DeleteTensorHandle};
     }
 
-    tensor::tensor(TF_Tensor* t) {
-        this->tf_tensor = {t, TF_DeleteTensor};
+    tensor::tensor(TF_Tensor* t) : tensor(std::shared_ptr<TF_Tensor>(t, TF_DeleteTensor)) {}
+
+    tensor::tensor(std::shared_ptr<TF_Tensor> t) {
+        this->tf_tensor = std::move(t);
         this->tfe_handle = {TFE_NewTensorHandle(this->tf_tensor.get(), context::get_status()), TFE_DeleteTensorHandle};
         status_check(context::get_status());
     }
 
     tensor tensor::shape() const {
-        auto op = TFE_NewOp(context::get_context(), "Shape", context::get_status());
-        status_check(context::get_status());
+        if (this->symbolic())
+            throw std::runtime_error{"The shape of a symbolic tensor is computed with cppflow::shape"};
+
+        cached_op op("Shape");
 
         TFE_OpAddInput(op, this->tfe_handle.get(), context::get_status());
         status_check(context::get_status());
@@ -200,18 +510,69 @@ namespace cppflow {
         TFE_TensorHandle* res[1];
         TFE_Execute(op, res, &n, context::get_status());
         status_check(context::get_status());
-        TFE_DeleteOp(op);
 
-        tensor r;
-        r.tf_tensor = { TFE_TensorHandleResolve(res[0], context::get_status()), TF_DeleteTensor};
+        return tensor(res[0]);
+    }
+
+    dim_vector tensor::dims() const {
+        if (this->symbolic())
+            throw std::runtime_error{"A symbolic tensor has no value until its graph is run"};
+
+        auto n = TFE_TensorHandleNumDims(this->tfe_handle.get(), context::get_status());
         status_check(context::get_status());
-        r.tfe_handle = {TFE_NewTensorHandle(r.tf_tensor.get(), context::get_status()), TFE_DeleteTensorHandle};
+
+        dim_vector res(n);
+        for (int i = 0; i < n; i++) {
+            res[i] = TFE_TensorHandleDim(this->tfe_handle.get(), i, context::get_status());
+            status_check(context::get_status());
+        }
+        return res;
+    }
+
+    const dim_vector& tensor::cached_dims() const {
+        auto res = std::atomic_load(&this->dims_);
+        if (!res) {
+            // Only the first thread publishes its result, so the returned reference stays valid while the tensor lives
+            std::shared_ptr<const dim_vector> expected;
+            res = std::make_shared<const dim_vector>(this->dims());
+            if (!std::atomic_compare_exchange_strong(&this->dims_, &expected, res))
+                res = expected;
+        }
+        return *res;
+    }
+
+    int tensor::rank() const {
+        if (this->symbolic())
+            throw std::runtime_error{"A symbolic tensor has no value until its graph is run"};
+
+        auto n = TFE_TensorHandleNumDims(this->tfe_handle.get(), context::get_status());
         status_check(context::get_status());
+        return n;
+    }
 
-        return r;
+    size_t tensor::byte_size(datatype type, const std::vector<int64_t>& shape) {
+        size_t elements = 1;
+        for (auto dim : shape) {
+            if (dim < 0)
+                throw std::runtime_error{"Shape has an unknown or negative dimension: " + std::to_string(dim)};
+            elements *= (size_t)dim;
+        }
+        return elements * TF_DataTypeSize(type);
+    }
+
+    int64_t tensor::num_elements() const {
+        if (this->symbolic())
+            throw std::runtime_error{"A symbolic tensor has no value until its graph is run"};
+
+        auto n = TFE_TensorHandleNumElements(this->tfe_handle.get(), context::get_status());
+        status_check(context::get_status());
+        return n;
     }
 
     std::string tensor::device(bool on_memory) const {
+        if (this->symbolic())
+            throw std::runtime_error{"A symbolic tensor has no value until its graph is run"};
+
         std::string res;
         if (on_memory)
             res = TFE_TensorHandleBackingDeviceName(this->tfe_handle.get(), context::get_status());
@@ -224,38 +585,157 @@ namespace cppflow {
 
     template<typename T>
     std::vector<T> tensor::data() const {
-        auto res_tensor = TFE_TensorHandleResolve(this->tfe_handle.get(), context::get_status());
-        status_check(context::get_status());
+        auto res_tensor = this->get_tensor();
 
         // Check tensor data is not empty
-        auto raw_data = TF_TensorData(res_tensor);
+        auto raw_data = TF_TensorData(res_tensor.get());
         //this->error_check(raw_data != nullptr, "Tensor data is empty");
 
-        size_t size = TF_TensorByteSize(res_tensor) / TF_DataTypeSize(TF_TensorType(res_tensor));
+        size_t size = TF_TensorByteSize(res_tensor.get()) / TF_DataTypeSize(TF_TensorType(res_tensor.get()));
 
         // Convert to correct type
         const auto T_data = static_cast<T*>(raw_data);
         return std::vector<T>(T_data, T_data + size);
     }
 
+    template<typename T>
+    tensor_view<T> tensor::view() const {
+        if (this->dtype() != deduce_tf_type<typename std::remove_const<T>::type>())
+            throw std::runtime_error{"Cannot view a " + to_string(this->dtype()) + " tensor as " + to_string(deduce_tf_type<typename std::remove_const<T>::type>())};
+
+        auto res_tensor = this->get_tensor();
+        auto t = res_tensor.get();
+        return tensor_view<T>(std::move(res_tensor), t);
+    }
+
+    dim_vector::dim_vector(size_t rank) : size_(rank) {
+        if (rank > max_inline_dims)
+            this->heap_.resize(rank);
+    }
+
+    bool dim_vector::operator==(const dim_vector& other) const {
+        return this->size_ == other.size_ && std::equal(this->begin(), this->end(), other.begin());
+    }
+
+    template<typename T>
+    tensor_view<T>::tensor_view(std::shared_ptr<TF_Tensor> holder, T* data, size_t size, std::vector<int64_t> shape) :
+        holder_(std::move(holder)), data_(data), size_(size), shape_(std::move(shape)), strides_(shape_.size()) {
+        int64_t stride = 1;
+        for (int i = (int)this->shape_.size() - 1; i >= 0; i--) {
+            this->strides_[i] = stride;
+            stride *= this->shape_[i];
+        }
+    }
+
+    template<typename T>
+    tensor_view<T>::tensor_view(std::shared_ptr<TF_Tensor> holder, TF_Tensor* t) :
+        holder_(std::move(holder)), data_(static_cast<T*>(TF_TensorData(t))), size_(TF_TensorByteSize(t) / sizeof(T)),
+        shape_(TF_NumDims(t)), strides_(shape_.size()) {
+        if (TF_TensorType(t) != deduce_tf_type<typename std::remove_const<T>::type>())
+            throw std::runtime_error{"Cannot view a " + to_string(TF_TensorType(t)) + " tensor as " + to_string(deduce_tf_type<typename std::remove_const<T>::type>())};
+
+        int64_t stride = 1;
+        for (int i = (int)this->shape_.size() - 1; i >= 0; i--) {
+            this->shape_[i] = TF_Dim(t, i);
+            this->strides_[i] = stride;
+            stride *= this->shape_[i];
+        }
+    }
+
+    template<typename T>
+    T& tensor_view<T>::at(size_t i) const {
+        if (i >= this->size_)
+            throw std::out_of_range{"Index " + std::to_string(i) + " out of range for a view of " + std::to_string(this->size_) + " elements"};
+        return this->data_[i];
+    }
+
+    template<typename T>
+    T& tensor_view<T>::at(const std::vector<int64_t>& index) const {
+        if (index.size() != this->shape_.size())
+            throw std::out_of_range{"Index of rank " + std::to_string(index.size()) + " for a view of rank " + std::to_string(this->shape_.size())};
+
+        size_t offset = 0;
+        for (size_t i = 0; i < index.size(); i++) {
+            if (index[i] < 0 || index[i] >= this->shape_[i])
+                throw std::out_of_range{"Index " + std::to_string(index[i]) + " out of range for dimension " + std::to_string(i)};
+            offset += index[i] * this->strides_[i];
+        }
+        return this->data_[offset];
+    }
+
     void* tensor::data() const
     {
-		auto res_tensor = TFE_TensorHandleResolve(this->tfe_handle.get(), context::get_status());
-		status_check(context::get_status());
+		return TF_TensorData(this->get_tensor().get());
+    }
+    tensor::tensor(const tensor &other)
+        : tfe_handle(other.tfe_handle), tf_output(other.tf_output),
+          tf_tensor(std::atomic_load(&other.tf_tensor)), dims_(std::atomic_load(&other.dims_)) {}
+
+    tensor::tensor(tensor &&other) noexcept
+        : tfe_handle(std::move(other.tfe_handle)), tf_output(other.tf_output),
+          tf_tensor(std::atomic_exchange(&other.tf_tensor, std::shared_ptr<TF_Tensor>())),
+          dims_(std::atomic_exchange(&other.dims_, std::shared_ptr<const dim_vector>())) {
+        other.tf_output = {nullptr, 0};
+    }
 
-		// Check tensor data is not empty
-		return TF_TensorData(res_tensor);
+    tensor &tensor::operator=(const tensor &other) {
+        if (this == &other)
+            return *this;
+
+        this->tfe_handle = other.tfe_handle;
+        this->tf_output = other.tf_output;
+        std::atomic_store(&this->tf_tensor, std::atomic_load(&other.tf_tensor));
+        std::atomic_store(&this->dims_, std::atomic_load(&other.dims_));
+        return *this;
     }
+
+    tensor &tensor::operator=(tensor &&other) noexcept {
+        if (this == &other)
+            return *this;
+
+        this->tfe_handle = std::move(other.tfe_handle);
+        this->tf_output = other.tf_output;
+        other.tf_output = {nullptr, 0};
+        std::atomic_store(&this->tf_tensor, std::atomic_exchange(&other.tf_tensor, std::shared_ptr<TF_Tensor>()));
+        std::atomic_store(&this->dims_, std::atomic_exchange(&other.dims_, std::shared_ptr<const dim_vector>()));
+        return *this;
+    }
+
     datatype tensor::dtype() const {
+        if (this->symbolic())
+            return TF_OperationOutputType(this->tf_output);
         return TFE_TensorHandleDataType(this->tfe_handle.get());
     }
 
 	size_t tensor::size() const
 	{
-		auto res_tensor = TFE_TensorHandleResolve(this->tfe_handle.get(), context::get_status());
-		status_check(context::get_status());
-        return TF_TensorByteSize(res_tensor);
+        return TF_TensorByteSize(this->get_tensor().get());
 	}
+
+    std::shared_ptr<TF_Tensor> tensor::get_tensor() const {
+        // Copies of a tensor may be read from several threads, so the cache is accessed atomically
+        auto res_tensor = std::atomic_load(&this->tf_tensor);
+        if (res_tensor)
+            return res_tensor;
+
+        if (this->symbolic())
+            throw std::runtime_error{"A symbolic tensor has no value until its graph is run"};
+
+        auto t = TFE_TensorHandleResolve(this->tfe_handle.get(), context::get_status());
+        status_check(context::get_status());
+        resolves().fetch_add(1, std::memory_order_relaxed);
+
+        // Only the first thread publishes its result, so the returned tensor stays valid while this one lives
+        std::shared_ptr<TF_Tensor> expected;
+        res_tensor = {t, TF_DeleteTensor};
+        if (!std::atomic_compare_exchange_strong(&this->tf_tensor, &expected, res_tensor))
+            res_tensor = expected;
+        return res_tensor;
+    }
+
+    uint64_t tensor::resolve_count() {
+        return resolves().load(std::memory_order_relaxed);
+    }
 }
 
 #endif //CPPFLOW2_TENSOR_H